@@ -0,0 +1,104 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// 宛先のCPUを一つずつ変えながらタスクを登録した時の、1タスクあたりの時間を
+// Registerを繰り返す場合とRegisterBatchでまとめる場合で、バッチサイズ1..1024について測る
+// callは登録する呼び出しだけ、totalは全てのタスクが実行されるまでの時間
+// usage: batch [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時は17（CPU 1..16に振り分ける）
+// CPU 0（mainのスレッド）が登録する
+
+#include "bench.h"
+#include <global.h>
+#include <task.h>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+static const int kDefaultThreads = 17;
+static const int kMaxBatch = 1024;
+static const int kTasksPerSize = 20 * 1000;
+
+static int workers;
+static volatile long ran;
+
+static void Count(void *) {
+  __sync_fetch_and_add(&ran, 1);
+}
+
+static Task *tasks[kMaxBatch];
+static int cpuids[kMaxBatch];
+
+static void Bench(int n, bool batch, double &call, double &total) {
+  int rounds = (kTasksPerSize + n - 1) / n;
+  uint64_t call_time = 0;
+  ran = 0;
+  uint64_t start = BenchNow();
+  for (int r = 0; r < rounds; r++) {
+    uint64_t call_start = BenchNow();
+    if (batch) {
+      task_ctrl->RegisterBatch(tasks, cpuids, n);
+    } else {
+      for (int i = 0; i < n; i++) {
+        task_ctrl->Register(cpuids[i], tasks[i]);
+      }
+    }
+    call_time += BenchNow() - call_start;
+    // 全て実行されてから次を登録する（実行中のタスクは再び積まれてしまうため）
+    while(ran != static_cast<long>(n) * (r + 1)) {
+      sched_yield();
+    }
+  }
+  uint64_t elapsed = BenchNow() - start;
+  call = static_cast<double>(call_time) / (static_cast<double>(n) * rounds);
+  total = static_cast<double>(elapsed) / (static_cast<double>(n) * rounds);
+}
+
+static void Driver() {
+  Function func;
+  func.Init(Count, nullptr);
+  for (int i = 0; i < kMaxBatch; i++) {
+    tasks[i] = new Task;
+    tasks[i]->SetFunc(func);
+    cpuids[i] = 1 + i % workers;
+  }
+  for (int n = 1; n <= kMaxBatch; n *= 2) {
+    double call, total, batch_call, batch_total;
+    Bench(n, false, call, total);
+    Bench(n, true, batch_call, batch_total);
+    printf("batch %4d over %2d cpus: Register call %7.1f total %8.1f  RegisterBatch call %7.1f total %8.1f ns/task\n",
+           n, workers, call, total, batch_call, batch_total);
+  }
+  for (int i = 0; i < kMaxBatch; i++) {
+    BenchWaitTask(*tasks[i]);
+    delete tasks[i];
+  }
+}
+
+int main(int argc, char **argv) {
+  int threads = (argc > 1) ? BenchThreads(argc, argv) : kDefaultThreads;
+  workers = threads - 1;
+  BenchSetup(threads);
+  BenchRun(Driver);
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#include "bench.h"
+#include <global.h>
+#include <raph.h>
+#include <task.h>
+#include <mem/uvirtmem.h>
+#include <dev/posixtimer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+VirtmemCtrl *virtmem_ctrl;
+
+void kernel_panic(const char *class_name, const char *err_str) {
+  fprintf(stderr, "[%s] %s\n", class_name, err_str);
+  abort();
+}
+
+void checkpoint(int id, const char *str) {
+}
+
+void _checkpoint(const char *func, const int line) {
+}
+
+PthreadCtrl *BenchSetup(int threads) {
+  setvbuf(stdout, nullptr, _IONBF, 0);
+  virtmem_ctrl = new UVirtmemCtrl;
+  PthreadCtrl *pthread_ctrl = new PthreadCtrl(threads);
+  cpu_ctrl = pthread_ctrl;
+  PosixTimer *posix_timer = new PosixTimer;
+  posix_timer->Setup();
+  timer = posix_timer;
+  task_ctrl = new TaskCtrl;
+  task_ctrl->Setup();
+  pthread_ctrl->Setup();
+  return pthread_ctrl;
+}
+
+uint64_t BenchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int BenchThreads(int argc, char **argv) {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN) + 1;
+  if (argc > 1) {
+    threads = atoi(argv[1]);
+  }
+  if (threads < 2) {
+    fprintf(stderr, "threads must be at least 2\n");
+    exit(1);
+  }
+  return threads;
+}
+
+static void (*bench_driver)();
+
+static void RunDriver(void *) {
+  bench_driver();
+  exit(0);
+}
+
+void BenchRun(void (*driver)()) {
+  bench_driver = driver;
+  Task task;
+  Function func;
+  func.Init(RunDriver, nullptr);
+  task.SetFunc(func);
+  // ParallelForでCPU 0も計算に加われるよう、mainのスレッドもワーカーとして動かす
+  task_ctrl->Register(0, &task);
+  task_ctrl->Run();
+}
+
+static volatile int ready;
+static volatile bool go;
+static volatile int finished;
+
+void BenchReset() {
+  ready = 0;
+  go = false;
+  finished = 0;
+}
+
+void BenchWaitStart() {
+  __sync_fetch_and_add(&ready, 1);
+  while(!go) {
+    sched_yield();
+  }
+}
+
+void BenchFinish() {
+  __sync_fetch_and_add(&finished, 1);
+}
+
+uint64_t BenchStart(int n) {
+  while(ready != n) {
+    sched_yield();
+  }
+  uint64_t start = BenchNow();
+  go = true;
+  return start;
+}
+
+void BenchWaitFinish(int n) {
+  while(finished != n) {
+    sched_yield();
+  }
+}
+
+void BenchWaitTask(Task &task) {
+  while(task.GetStatus() != Task::Status::kOutOfQueue) {
+    sched_yield();
+  }
+}
+
+uint64_t BenchRunOnWorkers(int n, void (*func)(void *), void **args) {
+  BenchReset();
+  std::vector<Task> tasks(n);
+  for (int i = 0; i < n; i++) {
+    Function f;
+    f.Init(func, args[i]);
+    tasks[i].SetFunc(f);
+    task_ctrl->Register(1 + i, &tasks[i]);
+  }
+  uint64_t start = BenchStart(n);
+  BenchWaitFinish(n);
+  uint64_t elapsed = BenchNow() - start;
+  for (int i = 0; i < n; i++) {
+    BenchWaitTask(tasks[i]);
+  }
+  return elapsed;
+}
+
+uint32_t BenchPercentile(const std::vector<uint32_t> &samples, double p) {
+  size_t i = static_cast<size_t>(samples.size() * p);
+  if (i >= samples.size()) {
+    i = samples.size() - 1;
+  }
+  return samples[i];
+}
@@ -0,0 +1,67 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// ベンチマーク共通の初期化と計測
+
+#ifndef __RAPH_BENCH_BENCH_H__
+#define __RAPH_BENCH_BENCH_H__
+
+#include <stdint.h>
+#include <thread.h>
+#include <task.h>
+#include <vector>
+
+// threads個のワーカーでrlibを初期化する
+// 呼び出したスレッドはCPU 0になり、CPU 1以降でtask_ctrlが動き始める
+PthreadCtrl *BenchSetup(int threads);
+
+// CLOCK_MONOTONICのns
+uint64_t BenchNow();
+
+// 引数の先頭をPthreadCtrlのスレッド数として読む（省略時はオンラインのCPU数+1）
+int BenchThreads(int argc, char **argv);
+
+// mainのスレッドもCPU 0のワーカーとして動かし、そこでdriverを実行する
+// driverから戻るとプロセスを終了する
+void BenchRun(void (*driver)());
+
+// 複数のワーカーで計測を一斉に始める
+// CPU 0がBenchResetしてからタスクを登録し、BenchStartで開始の合図を出す
+// ワーカーは計測の前にBenchWaitStart、終わったらBenchFinishを呼ぶ
+void BenchReset();
+void BenchWaitStart();
+void BenchFinish();
+// n個のワーカーが揃ったら始めさせ、開始時刻を返す
+uint64_t BenchStart(int n);
+// n個のワーカーがBenchFinishを呼ぶまで待つ
+void BenchWaitFinish(int n);
+
+// taskがキューから外れ、破棄できるようになるまで待つ
+void BenchWaitTask(Task &task);
+
+// CPU 1..nでfunc(args[i])を一つずつ動かし、全て終わるまでの時間(ns)を返す
+uint64_t BenchRunOnWorkers(int n, void (*func)(void *), void **args);
+
+// ソート済みのsamplesから、割合pの位置の値を返す
+uint32_t BenchPercentile(const std::vector<uint32_t> &samples, double p);
+
+#endif // __RAPH_BENCH_BENCH_H__
@@ -0,0 +1,262 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// Calloutの登録(arm)、キャンセル、期限切れの取り出し(expire)にかかる時間を、
+// 既にN個のCalloutが待っている状態で測る
+// 比較のため、以前の実装と同じ期限順の片方向リストも同じ条件で測る
+// expireはどちらも、期限切れを一つずつロックを取って取り出す時間
+// fireは、期限切れのCalloutがタスクキューを通して続けて実行される間隔
+
+#include "bench.h"
+#include <global.h>
+#include <task.h>
+#include <spinlock.h>
+#include <timerwheel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const int kCpuid = 1;
+// 待たせておくCalloutの期限（us）
+static const int kFarMin = 1000 * 1000;
+static const int kFarRange = 100 * 1000 * 1000;
+static const int kExpireDelay = 20 * 1000; // us
+
+static volatile int fired = 0;
+static volatile uint64_t first_fired;
+static volatile uint64_t last_fired;
+
+static void Handle(void *) {
+  uint64_t now = BenchNow();
+  if (fired == 0) {
+    first_fired = now;
+  }
+  last_fired = now;
+  fired++;
+}
+
+static int Far() {
+  return kFarMin + rand() % kFarRange;
+}
+
+static Callout *NewCallouts(int n) {
+  Callout *callouts = new Callout[n];
+  Function func;
+  func.Init(Handle, nullptr);
+  for (int i = 0; i < n; i++) {
+    callouts[i].Init(func);
+  }
+  return callouts;
+}
+
+// 実行中か実行待ちのCalloutを破棄しないよう、キューから外れるまで待つ
+static void WaitCallouts(Callout *callouts, int n) {
+  for (int i = 0; i < n; i++) {
+    while(callouts[i].GetStatus() != Task::Status::kOutOfQueue) {
+      usleep(100);
+    }
+  }
+}
+
+// TaskCtrl::ExpireCalloutsと同じく、ロックを取ってTimerWheelから期限切れを取り出す
+// 有効でないCPUを指定してSetHandlerすると、期限だけ設定されてどのキューにも積まれないので、
+// それをこのTimerWheelに直接積む
+static const int kNoCpu = -1;
+
+static uint64_t ExpireWheel(Callout *waiting, int pending, Callout *callouts, int ops) {
+  TimerWheel wheel;
+  IntSpinLock lock;
+  for (int i = 0; i < pending; i++) {
+    waiting[i].SetHandler(kNoCpu, Far());
+    Locker locker(lock);
+    wheel.Add(&waiting[i]);
+  }
+  for (int i = 0; i < ops; i++) {
+    callouts[i].SetHandler(kNoCpu, 0);
+    Locker locker(lock);
+    wheel.Add(&callouts[i]);
+  }
+  // 期限はtick単位に切り上げられるので、少し先の時刻で取り出す
+  // (待っている方の期限はkFarMin以上先なので、取り出されない)
+  uint64_t now = timer->GetCntAfterPeriod(timer->ReadMainCnt(), kExpireDelay);
+  uint64_t start = BenchNow();
+  int expired = 0;
+  while(true) {
+    Locker locker(lock);
+    Callout *c = wheel.GetExpired(now);
+    if (c == nullptr) {
+      break;
+    }
+    wheel.Remove(c);
+    expired++;
+  }
+  uint64_t expire = BenchNow() - start;
+  kassert(expired == ops);
+  for (int i = 0; i < pending; i++) {
+    wheel.Remove(&waiting[i]);
+  }
+  return expire;
+}
+
+static void BenchWheel(int pending, int ops) {
+  Callout *waiting = NewCallouts(pending);
+  Callout *callouts = NewCallouts(ops);
+  for (int i = 0; i < pending; i++) {
+    waiting[i].SetHandler(kCpuid, Far());
+  }
+
+  uint64_t start = BenchNow();
+  for (int i = 0; i < ops; i++) {
+    callouts[i].SetHandler(kCpuid, Far());
+  }
+  uint64_t arm = BenchNow() - start;
+
+  start = BenchNow();
+  for (int i = 0; i < ops; i++) {
+    callouts[i].Cancel();
+  }
+  uint64_t cancel = BenchNow() - start;
+
+  // 全て同じ期限にして、タスクキューを通して続けて実行される間隔を測る
+  fired = 0;
+  for (int i = 0; i < ops; i++) {
+    callouts[i].SetHandler(kCpuid, kExpireDelay);
+  }
+  while(fired != ops) {
+    usleep(1000);
+  }
+  uint64_t fire = last_fired - first_fired;
+  WaitCallouts(callouts, ops);
+
+  for (int i = 0; i < pending; i++) {
+    waiting[i].Cancel();
+  }
+  WaitCallouts(waiting, pending);
+
+  uint64_t expire = ExpireWheel(waiting, pending, callouts, ops);
+
+  printf("wheel %8d pending: arm %8.1f ns  cancel %8.1f ns  expire %8.1f ns  fire %8.1f ns\n",
+         pending, static_cast<double>(arm) / ops, static_cast<double>(cancel) / ops,
+         static_cast<double>(expire) / ops, static_cast<double>(fire) / ops);
+
+  delete[] callouts;
+  delete[] waiting;
+}
+
+// 以前のTaskCtrl::RegisterCallout/CancelCalloutと同じく、期限順のリストを辿る
+class SortedList {
+public:
+  struct Node {
+    uint64_t time;
+    Node *next;
+  };
+  void Add(Node *node) {
+    Locker locker(_lock);
+    Node *n = &_head;
+    while(n->next != nullptr && n->next->time <= node->time) {
+      n = n->next;
+    }
+    node->next = n->next;
+    n->next = node;
+  }
+  void Remove(Node *node) {
+    Locker locker(_lock);
+    for (Node *n = &_head; n->next != nullptr; n = n->next) {
+      if (n->next == node) {
+        n->next = node->next;
+        break;
+      }
+    }
+    node->next = nullptr;
+  }
+  // 期限切れの先頭を取り出す
+  Node *PopExpired(uint64_t time) {
+    Locker locker(_lock);
+    Node *n = _head.next;
+    if (n == nullptr || n->time > time) {
+      return nullptr;
+    }
+    _head.next = n->next;
+    return n;
+  }
+private:
+  Node _head = {0, nullptr};
+  SpinLock _lock;
+};
+
+static void BenchList(int pending, int ops) {
+  SortedList list;
+  SortedList::Node *waiting = new SortedList::Node[pending];
+  SortedList::Node *nodes = new SortedList::Node[ops];
+  uint64_t now = BenchNow();
+  // 先に期限順に並べておき、構築にO(N^2)かからないようにする
+  uint64_t time = now + kFarMin * 1000ULL;
+  for (int i = pending - 1; i >= 0; i--) {
+    waiting[i].time = time + static_cast<uint64_t>(kFarRange) * 1000 * i / pending;
+    list.Add(&waiting[i]);
+  }
+
+  uint64_t start = BenchNow();
+  for (int i = 0; i < ops; i++) {
+    nodes[i].time = now + Far() * 1000ULL;
+    list.Add(&nodes[i]);
+  }
+  uint64_t arm = BenchNow() - start;
+
+  start = BenchNow();
+  for (int i = 0; i < ops; i++) {
+    list.Remove(&nodes[i]);
+  }
+  uint64_t cancel = BenchNow() - start;
+
+  for (int i = 0; i < ops; i++) {
+    nodes[i].time = now;
+    list.Add(&nodes[i]);
+  }
+  start = BenchNow();
+  int expired = 0;
+  while(list.PopExpired(now) != nullptr) {
+    expired++;
+  }
+  uint64_t expire = BenchNow() - start;
+  kassert(expired == ops);
+
+  printf("list  %8d pending: arm %8.1f ns  cancel %8.1f ns  expire %8.1f ns\n",
+         pending, static_cast<double>(arm) / ops, static_cast<double>(cancel) / ops,
+         static_cast<double>(expire) / ops);
+
+  delete[] nodes;
+  delete[] waiting;
+}
+
+int main(int argc, char **argv) {
+  BenchSetup(2);
+  srand(1);
+  const int kPending[] = {10 * 1000, 1000 * 1000};
+  const int kOps = 10 * 1000;
+  for (int pending : kPending) {
+    BenchWheel(pending, kOps);
+    // リストは一回の操作がO(N)なので、回数を減らす
+    BenchList(pending, (pending > 100 * 1000) ? kOps / 100 : kOps);
+  }
+  return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// Functionalの起床が失われないかの負荷試験と、Pushする側のスループット
+// 最後に、リングバッファのFunctionalが既に登録済みの時の積む速さを、以前の実装と比べる
+// 負荷試験で取りこぼしがあれば、終了コード1で終わる
+
+#include "bench.h"
+#include <global.h>
+#include <task.h>
+#include <buf.h>
+#include <queue.h>
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+
+// CPU 1, 2で積み、CPU 3, 4で取り出す
+// 満杯の時に積む側が待ち続けるので、取り出す側と同じCPUに置いてはいけない
+static const int kThreads = 5;
+static const int kProducers = 2;
+static const int kConsumerCpuBase = 1 + kProducers;
+static const long kStressItems = 200 * 1000;
+static const int kStressRounds = 5;
+
+static FunctionalRingBuffer<long, 1000> *ring;
+static FunctionalMpmcRingBuffer<long, 1024> *mpmc;
+static FunctionalSpscRingBuffer<long, 1024> *spsc;
+static FunctionalQueue *queue;
+static FunctionalQueue *bench_queue;
+static volatile long received[4];
+static volatile int finished;
+
+static void PopRing(void *) {
+  long v;
+  while(ring->Pop(v)) {
+    received[0]++;
+  }
+}
+
+static void PopMpmc(void *) {
+  long v;
+  while(mpmc->Pop(v)) {
+    received[1]++;
+  }
+}
+
+static void PopSpsc(void *) {
+  long v;
+  while(spsc->Pop(v)) {
+    received[2]++;
+  }
+}
+
+static void PopQueue(void *) {
+  void *v;
+  while(queue->Pop(v)) {
+    received[3]++;
+  }
+}
+
+// 消費側が止まる瞬間と重なるよう、時々少しだけ休みながら積む
+static void Produce(void *arg) {
+  long id = reinterpret_cast<long>(arg);
+  unsigned int seed = id * 7919 + 1;
+  for (long i = 0; i < kStressItems; i++) {
+    while(!ring->Push(i)) {
+      sched_yield();
+    }
+    while(!mpmc->Push(i)) {
+      sched_yield();
+    }
+    // SPSCは一つのスレッドからしか積めない
+    if (id == 0) {
+      while(!spsc->Push(i)) {
+        sched_yield();
+      }
+    }
+    queue->Push(reinterpret_cast<void *>(i));
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 16) % 5000 == 0) {
+      usleep(50);
+    }
+  }
+  __sync_fetch_and_add(&finished, 1);
+}
+
+static bool StressRound(int round) {
+  for (int i = 0; i < 4; i++) {
+    received[i] = 0;
+  }
+  finished = 0;
+  Task producers[kProducers];
+  for (long i = 0; i < kProducers; i++) {
+    Function produce;
+    produce.Init(Produce, reinterpret_cast<void *>(i));
+    producers[i].SetFunc(produce);
+    task_ctrl->Register(1 + (round + i) % kProducers, &producers[i]);
+  }
+  while(finished != kProducers) {
+    usleep(1000);
+  }
+  // 起こし損ねていれば、ここで残ったままになる
+  const long expected[4] = {kProducers * kStressItems, kProducers * kStressItems, kStressItems, kProducers * kStressItems};
+  for (int i = 0; i < 200; i++) {
+    if (received[0] == expected[0] && received[1] == expected[1] &&
+        received[2] == expected[2] && received[3] == expected[3]) {
+      break;
+    }
+    usleep(5000);
+  }
+  bool ok = true;
+  const char *names[4] = {"ring", "mpmc", "spsc", "queue"};
+  for (int i = 0; i < 4; i++) {
+    if (received[i] != expected[i]) {
+      printf("stress round %d: %s received %ld of %ld\n", round, names[i], received[i], expected[i]);
+      ok = false;
+    }
+  }
+  for (int i = 0; i < kProducers; i++) {
+    while(producers[i].GetStatus() != Task::Status::kOutOfQueue) {
+      usleep(1000);
+    }
+  }
+  return ok;
+}
+
+static const long kBenchItems = 2 * 1000 * 1000;
+static volatile long bench_received;
+
+static void PopBench(void *) {
+  void *v;
+  while(bench_queue->Pop(v)) {
+    bench_received++;
+  }
+}
+
+static void ProduceBench(void *) {
+  for (long i = 0; i < kBenchItems; i++) {
+    bench_queue->Push(reinterpret_cast<void *>(i));
+  }
+  __sync_fetch_and_add(&finished, 1);
+}
+
+// producers個のタスクからFunctionalQueueに積み続け、1回のPushにかかる時間を測る
+static void BenchPush(int producers) {
+  bench_received = 0;
+  finished = 0;
+  Task tasks[kThreads];
+  uint64_t start = BenchNow();
+  for (int i = 0; i < producers; i++) {
+    Function produce;
+    produce.Init(ProduceBench, nullptr);
+    tasks[i].SetFunc(produce);
+    task_ctrl->Register(1 + i, &tasks[i]);
+  }
+  while(finished != producers) {
+    usleep(100);
+  }
+  uint64_t elapsed = BenchNow() - start;
+  while(bench_received != kBenchItems * producers) {
+    usleep(1000);
+  }
+  for (int i = 0; i < producers; i++) {
+    while(tasks[i].GetStatus() != Task::Status::kOutOfQueue) {
+      usleep(1000);
+    }
+  }
+  printf("push %d producers: %.1f ns/push  %.1f Mpush/s\n", producers,
+         static_cast<double>(elapsed) / kBenchItems,
+         kBenchItems * producers * 1000.0 / elapsed);
+}
+
+// 以前のFunctionalと同じく、登録済みかをロックを取って確かめるリングバッファ
+// (FunctionalSpscRingBuffer、FunctionalMpmcRingBufferもメモリバリアは置いていなかった)
+template<class Buf>
+class LegacyFunctionalBuffer {
+ public:
+  LegacyFunctionalBuffer(const GenericFunction &func) {
+    _func.Copy(func);
+  }
+  bool Push(long data) {
+    bool flag = _buf.Push(data);
+    WakeupFunction();
+    return flag;
+  }
+  bool Pop(long &data) {
+    return _buf.Pop(data);
+  }
+ private:
+  void WakeupFunction() {
+    if (!_func.CanExecute()) {
+      return;
+    }
+    Locker locker(_lock);
+    if (_state == Functional::FunctionState::kFunctioning) {
+      return;
+    }
+    // 計測中は常に登録済みなので、ここには来ない
+    kassert(false);
+  }
+  Buf _buf;
+  FunctionBase _func;
+  SpinLock _lock;
+  Functional::FunctionState _state = Functional::FunctionState::kFunctioning;
+};
+
+static const int kScheduledOps = 2 * 1000 * 1000;
+static volatile bool release_blocker;
+
+static void Block(void *) {
+  while(!release_blocker) {
+    usleep(100);
+  }
+}
+
+// 積んだ側が取り出すので、何もしない
+static void Drain(void *) {
+}
+
+// 既にタスクが登録済みのFunctionalに、1回積んで取り出すまでの時間
+template<class F>
+static double PushPop(F &f) {
+  long v;
+  uint64_t start = BenchNow();
+  for (long i = 0; i < kScheduledOps; i++) {
+    f.Push(i);
+    f.Pop(v);
+  }
+  return static_cast<double>(BenchNow() - start) / kScheduledOps;
+}
+
+// Functionalの登録済みタスクをCPU kThreads - 1で待たせておき、その間にCPU 0から積む
+template<class F, class Buf>
+static void BenchScheduled(const char *name) {
+  Function func;
+  func.Init(Drain, nullptr);
+  LegacyFunctionalBuffer<Buf> legacy(func);
+  double before = PushPop(legacy);
+
+  release_blocker = false;
+  Task blocker;
+  Function block;
+  block.Init(Block, nullptr);
+  blocker.SetFunc(block);
+  task_ctrl->Register(kThreads - 1, &blocker);
+  F *f = new F;
+  f->SetFunction(kThreads - 1, func);
+  // 一度起こせば、blockerが終わるまで登録済みのまま
+  f->Push(0);
+  double after = PushPop(*f);
+  // 空にしてから実行させれば、Drainを一度呼んだだけで登録済みでなくなる
+  long v;
+  while(f->Pop(v)) {
+  }
+  release_blocker = true;
+  BenchWaitTask(blocker);
+  printf("scheduled %-26s: push+pop before %6.1f  after %6.1f ns\n", name, before, after);
+  // Functionalのタスクが実行を終えていない事があるので、破棄しない
+}
+
+int main(int argc, char **argv) {
+  BenchSetup(kThreads);
+  ring = new FunctionalRingBuffer<long, 1000>;
+  mpmc = new FunctionalMpmcRingBuffer<long, 1024>;
+  spsc = new FunctionalSpscRingBuffer<long, 1024>;
+  queue = new FunctionalQueue;
+  bench_queue = new FunctionalQueue;
+  // 取り出す側のCPUはSetFunctionでしか決められないので、試験の間は固定する
+  Function func;
+  func.Init(PopRing, nullptr);
+  ring->SetFunction(kConsumerCpuBase, func);
+  func.Init(PopMpmc, nullptr);
+  mpmc->SetFunction(kConsumerCpuBase + 1, func);
+  func.Init(PopSpsc, nullptr);
+  spsc->SetFunction(kConsumerCpuBase, func);
+  func.Init(PopQueue, nullptr);
+  queue->SetFunction(kConsumerCpuBase + 1, func);
+  func.Init(PopBench, nullptr);
+  bench_queue->SetFunction(kThreads - 1, func);
+  usleep(10000);
+
+  bool ok = true;
+  for (int round = 0; round < kStressRounds; round++) {
+    ok = StressRound(round) && ok;
+  }
+  printf("stress: %s\n", ok ? "ok" : "lost wakeup");
+
+  for (int producers = 1; producers < kThreads - 1; producers++) {
+    BenchPush(producers);
+  }
+
+  BenchScheduled<FunctionalRingBuffer<long, 1024>, RingBuffer<long, 1024>>("FunctionalRingBuffer");
+  BenchScheduled<FunctionalSpscRingBuffer<long, 1024>, SpscRingBuffer<long, 1024>>("FunctionalSpscRingBuffer");
+  BenchScheduled<FunctionalMpmcRingBuffer<long, 1024>, MpmcRingBuffer<long, 1024>>("FunctionalMpmcRingBuffer");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// PthreadCtrl::GetIdと、ロックする度にGetIdを呼ぶSpinLockのロック・アンロック1回あたりの時間
+// 比較のため、以前の実装（gettidを呼び、スレッドIDの表を先頭から探す）も同じ条件で測る
+// usage: getid [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時はオンラインのCPU数+1
+// CPU 0（mainのスレッド）だけで測る。以前の実装では、表の末尾のCPUほど遅くなる
+
+#include "bench.h"
+#include <global.h>
+#include <spinlock.h>
+#include <vector>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+static const int kOps = 1000 * 1000;
+
+static int threads;
+static std::vector<int> thread_ids;
+static volatile long counter;
+
+// 以前のPthreadCtrl::GetId
+static int LegacyGetId() {
+  int tid = syscall(SYS_gettid);
+  for (int i = 0; i < threads; i++) {
+    if (thread_ids[i] == tid) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// SpinLockと同じく、ロックする度にLegacyGetIdを呼ぶ
+class LegacySpinLock {
+public:
+  void Lock() {
+    if ((_flag % 2) == 1) {
+      kassert(_id != LegacyGetId());
+    }
+    while(true) {
+      unsigned int flag = _flag;
+      if ((flag % 2) == 0 && __sync_bool_compare_and_swap(&_flag, flag, flag + 1)) {
+        break;
+      }
+    }
+    _id = LegacyGetId();
+  }
+  void Unlock() {
+    _id = -1;
+    _flag++;
+  }
+private:
+  volatile unsigned int _flag = 0;
+  volatile int _id = -1;
+};
+
+template <class F>
+static double Measure(F func) {
+  uint64_t start = BenchNow();
+  for (int i = 0; i < kOps; i++) {
+    func();
+  }
+  return static_cast<double>(BenchNow() - start) / kOps;
+}
+
+static void Driver() {
+  // CPU 0を表の末尾に置き、以前の実装で一番遠いCPUにする
+  thread_ids.assign(threads, -1);
+  thread_ids[threads - 1] = syscall(SYS_gettid);
+  double legacy = Measure([] { counter += LegacyGetId(); });
+  double current = Measure([] { counter += cpu_ctrl->GetId(); });
+  printf("getid %2d cpus: GetId                before %7.1f  after %6.1f ns\n", threads, legacy, current);
+  LegacySpinLock legacy_lock;
+  SpinLock lock;
+  legacy = Measure([&] { legacy_lock.Lock(); counter++; legacy_lock.Unlock(); });
+  current = Measure([&] { lock.Lock(); counter++; lock.Unlock(); });
+  printf("getid %2d cpus: SpinLock lock+unlock before %7.1f  after %6.1f ns\n", threads, legacy, current);
+}
+
+int main(int argc, char **argv) {
+  threads = BenchThreads(argc, argv);
+  BenchSetup(threads);
+  BenchRun(Driver);
+  return 0;
+}
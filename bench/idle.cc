@@ -0,0 +1,133 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// TaskCtrl::IdlePolicy毎に、キューが空のCPUにタスクを登録してから
+// 実行されるまでの時間と、何も登録しない間のCPU使用率を測る
+// usage: idle [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時はオンラインのCPU数+1
+// CPU 0（mainのスレッド）からCPU 1にタスクを登録する
+// 最後に、見張るIdlePolicyのままDeactivateしたCPU 2のCPU使用率を測る
+
+#include "bench.h"
+#include <global.h>
+#include <task.h>
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static const int kRounds = 1000;
+static const int kInterval = 200; // us
+static const int kWindow = 200 * 1000; // us
+
+static int threads;
+static PthreadCtrl *pthread_ctrl;
+
+static volatile int ran;
+static volatile uint64_t start_time;
+static volatile uint64_t latency;
+
+static void Wakeup(void *) {
+  latency = BenchNow() - start_time;
+  ran++;
+}
+
+static uint64_t ProcessCpuTime() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+// kWindowの間に、プロセス全体で使ったCPU時間の割合
+static double IdleCpu() {
+  uint64_t cpu = ProcessCpuTime();
+  uint64_t start = BenchNow();
+  usleep(kWindow);
+  cpu = ProcessCpuTime() - cpu;
+  uint64_t wall = BenchNow() - start;
+  return cpu * 100.0 / wall;
+}
+
+static void Bench(const char *name, const TaskCtrl::IdlePolicy &policy) {
+  task_ctrl->SetIdlePolicy(1, policy);
+  Task task;
+  Function func;
+  func.Init(Wakeup, nullptr);
+  task.SetFunc(func);
+  std::vector<uint32_t> samples(kRounds);
+  for (int i = 0; i < kRounds; i++) {
+    // CPU 1がキューを空にして待つ状態になってから登録する
+    usleep(kInterval);
+    int old = ran;
+    start_time = BenchNow();
+    task_ctrl->Register(1, &task);
+    while(ran == old) {
+      sched_yield();
+    }
+    samples[i] = latency;
+  }
+  BenchWaitTask(task);
+  double cpu = IdleCpu();
+  std::sort(samples.begin(), samples.end());
+  printf("idle %-16s: wakeup p50 %7u  p99 %8u ns  idle cpu %5.1f%%\n", name,
+         BenchPercentile(samples, 0.5), BenchPercentile(samples, 0.99), cpu);
+  TaskCtrl::IdlePolicy sleep = {0, 0};
+  task_ctrl->SetIdlePolicy(1, sleep);
+}
+
+// Deactivateされたcpuに見張るIdlePolicyを設定しても、見張らずに眠っている事を確かめる
+static void BenchDeactivated() {
+  if (threads < 3) {
+    printf("idle deactivated: needs at least 3 threads\n");
+    return;
+  }
+  TaskCtrl::IdlePolicy spin = {50, 0};
+  task_ctrl->SetIdlePolicy(2, spin);
+  pthread_ctrl->SetActiveThreads(2);
+  // CPU 2以降が移し終えて眠るまで待つ
+  usleep(kInterval);
+  double cpu = IdleCpu();
+  printf("idle %-16s: idle cpu %5.1f%%\n", "deactivated spin", cpu);
+  pthread_ctrl->SetActiveThreads(threads);
+  TaskCtrl::IdlePolicy sleep = {0, 0};
+  task_ctrl->SetIdlePolicy(2, sleep);
+}
+
+static void Driver() {
+  TaskCtrl::IdlePolicy sleep = {0, 0};
+  TaskCtrl::IdlePolicy spin = {kInterval * 2, 0};
+  TaskCtrl::IdlePolicy spin_yield = {kInterval / 10, kInterval * 2};
+  Bench("sleep (default)", sleep);
+  Bench("spin", spin);
+  Bench("spin then yield", spin_yield);
+  BenchDeactivated();
+}
+
+int main(int argc, char **argv) {
+  threads = BenchThreads(argc, argv);
+  pthread_ctrl = BenchSetup(threads);
+  BenchRun(Driver);
+  return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// SpinLockとTicketSpinLockを2..N個のCPUで取り合った時の、
+// スループットと取得待ち時間(p50/p99/p99.9/max)を測る
+// usage: lock [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時はオンラインのCPU数+1
+// CPU 0（mainのスレッド）が計測を進め、CPU 1以降で取り合う
+
+#include "bench.h"
+#include <global.h>
+#include <spinlock.h>
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+
+static const int kOps = 20 * 1000;
+
+static int workers;
+static volatile long counter;
+
+struct Arg {
+  SpinLockInterface *lock;
+  uint32_t *samples;
+};
+
+static void Worker(void *p) {
+  Arg *arg = reinterpret_cast<Arg *>(p);
+  BenchWaitStart();
+  for (int i = 0; i < kOps; i++) {
+    uint64_t start = BenchNow();
+    arg->lock->Lock();
+    arg->samples[i] = BenchNow() - start;
+    counter++;
+    arg->lock->Unlock();
+  }
+  BenchFinish();
+}
+
+static void Bench(const char *name, SpinLockInterface &lock, int n) {
+  std::vector<uint32_t> samples(kOps * n);
+  std::vector<Arg> args(n);
+  std::vector<void *> argp(n);
+  for (int i = 0; i < n; i++) {
+    args[i].lock = &lock;
+    args[i].samples = &samples[kOps * i];
+    argp[i] = &args[i];
+  }
+  counter = 0;
+  uint64_t elapsed = BenchRunOnWorkers(n, Worker, argp.data());
+  kassert(counter == static_cast<long>(kOps) * n);
+  std::sort(samples.begin(), samples.end());
+  printf("lock %-14s %2d cpus: %7.2f Mops/s  wait p50 %6u  p99 %8u  p99.9 %9u  max %9u ns\n",
+         name, n, kOps * n * 1000.0 / elapsed,
+         BenchPercentile(samples, 0.5), BenchPercentile(samples, 0.99),
+         BenchPercentile(samples, 0.999), samples.back());
+}
+
+static void Driver() {
+  for (int n = 2; n <= workers; n++) {
+    SpinLock spinlock;
+    TicketSpinLock ticketlock;
+    Bench("SpinLock", spinlock, n);
+    Bench("TicketSpinLock", ticketlock, n);
+  }
+}
+
+int main(int argc, char **argv) {
+  int threads = BenchThreads(argc, argv);
+  workers = threads - 1;
+  BenchSetup(threads);
+  BenchRun(Driver);
+  return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// 競合の無いロック・アンロック1回あたりの時間を、
+// Locker（仮想関数）とStaticLocker（インライン展開）で比べる
+// usage: locker
+// CPU 0（mainのスレッド）だけで測る
+// カーネル以外ではIntSpinLockとRawIntSpinLockは割り込みを禁止しないので、
+// cli/stiの分は含まれない
+
+#include "bench.h"
+#include <global.h>
+#include <spinlock.h>
+#include <stdio.h>
+
+static const int kOps = 10 * 1000 * 1000;
+static const int kTrials = 5;
+
+static volatile long counter;
+
+template <class LockT, class LockerT>
+static void Bench(const char *name) {
+  LockT lock;
+  double best = 0;
+  for (int t = 0; t < kTrials; t++) {
+    uint64_t start = BenchNow();
+    for (int i = 0; i < kOps; i++) {
+      LockerT locker(lock);
+      counter++;
+    }
+    double ns = static_cast<double>(BenchNow() - start) / kOps;
+    if (t == 0 || ns < best) {
+      best = ns;
+    }
+  }
+  printf("locker %-30s %6.2f ns\n", name, best);
+}
+
+static void Driver() {
+  Bench<SpinLock, Locker>("Locker + SpinLock");
+  Bench<RawSpinLock, StaticLocker<RawSpinLock>>("StaticLocker<RawSpinLock>");
+  Bench<IntSpinLock, Locker>("Locker + IntSpinLock");
+  Bench<RawIntSpinLock, StaticLocker<RawIntSpinLock>>("StaticLocker<RawIntSpinLock>");
+}
+
+int main(int argc, char **argv) {
+  BenchSetup(BenchThreads(argc, argv));
+  BenchRun(Driver);
+  return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// ParallelFor/ParallelReduceの、CPU数に対するスケーリングを測る
+//   memory:  配列を一度ずつ書き換える（メモリ帯域で律速される）
+//   compute: 要素毎にxorshiftを回して足し合わせる（計算で律速される）
+// usage: parallel [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時はオンラインのCPU数+1
+// 呼び出したCPU 0も計算に加わるので、SetActiveThreadsでCPU 0..n-1を動かしてn個で計算する
+
+#include "bench.h"
+#include <global.h>
+#include <parallel.h>
+#include <thread.h>
+#include <stdio.h>
+
+static const int64_t kMemoryElements = 8 * 1024 * 1024;
+static const int64_t kComputeElements = 1024 * 1024;
+static const int kRepeat = 5;
+
+static PthreadCtrl *pthread_ctrl;
+static int threads;
+static long *array;
+
+static void Memory() {
+  ParallelFor(0, kMemoryElements, 64 * 1024, [](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; i++) {
+        array[i] = array[i] * 3 + 1;
+      }
+    });
+}
+
+static uint64_t Compute() {
+  return ParallelReduce(0, kComputeElements, 4 * 1024, static_cast<uint64_t>(0), [](int64_t begin, int64_t end) {
+      uint64_t sum = 0;
+      for (int64_t i = begin; i < end; i++) {
+        uint64_t x = i + 1;
+        for (int j = 0; j < 64; j++) {
+          x ^= x << 13;
+          x ^= x >> 7;
+          x ^= x << 17;
+        }
+        sum += x;
+      }
+      return sum;
+    }, [](uint64_t a, uint64_t b) {
+      return a + b;
+    });
+}
+
+// kRepeat回のうち最も速かったものを返す
+template<class F>
+static uint64_t Best(F func) {
+  uint64_t best = ~static_cast<uint64_t>(0);
+  for (int i = 0; i < kRepeat; i++) {
+    uint64_t start = BenchNow();
+    func();
+    uint64_t elapsed = BenchNow() - start;
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+static void Driver() {
+  array = new long[kMemoryElements]();
+  uint64_t expected = 0;
+  uint64_t memory_base = 0;
+  uint64_t compute_base = 0;
+  for (int n = 1; n <= threads; n++) {
+    pthread_ctrl->SetActiveThreads(n);
+    uint64_t memory = Best(Memory);
+    uint64_t compute = Best([&]() {
+        uint64_t sum = Compute();
+        if (expected == 0) {
+          expected = sum;
+        }
+        kassert(sum == expected);
+      });
+    if (n == 1) {
+      memory_base = memory;
+      compute_base = compute;
+    }
+    printf("parallel %2d cpus: memory %8.2f ms (x%.2f)  compute %8.2f ms (x%.2f)\n", n,
+           memory / 1e6, static_cast<double>(memory_base) / memory,
+           compute / 1e6, static_cast<double>(compute_base) / compute);
+  }
+  pthread_ctrl->SetActiveThreads(threads);
+  delete[] array;
+}
+
+int main(int argc, char **argv) {
+  threads = BenchThreads(argc, argv);
+  pthread_ctrl = BenchSetup(threads);
+  BenchRun(Driver);
+  return 0;
+}
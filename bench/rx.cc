@@ -0,0 +1,141 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// PoolingSocketの受信の速さ(packets/s)と、受信コールバック1回あたりのパケット数を、
+// 1回のPollで受信するパケットの数(batch: 1..64)毎に測る
+// batch個のTCPクライアントが1パケットずつ送り、全て受信されてから次を送る
+// usage: rx [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時はオンラインのCPU数+1
+// PollはCPU 0で、受信コールバックはCPU 1で動き、別のスレッドから送る
+
+#include "bench.h"
+#include <global.h>
+#include <task.h>
+#include <net/psocket.h>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+static const int kMaxBatch = 64;
+static const int kRounds = 1000;
+static const int kPayload = 64;
+static const int kPortBase = 20000;
+
+static PoolingSocket *sock;
+static int port;
+static volatile long received;
+static volatile long callbacks;
+
+static void Receive(void *) {
+  PoolingSocket::Packet *packets[kMaxBatch];
+  int n;
+  callbacks++;
+  while((n = sock->ReceivePackets(packets, kMaxBatch)) != 0) {
+    sock->ReuseRxBuffers(packets, n);
+    received += n;
+  }
+}
+
+static int Connect() {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  addr.sin_port = htons(port);
+  while(true) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    kassert(fd >= 0);
+    // Pollが初めてlistenするまでは繋がらない
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0) {
+      // 前のパケットのACKを待たずに送る
+      int yes = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+      return fd;
+    }
+    close(fd);
+    usleep(1000);
+  }
+}
+
+static void WaitReceived(long n) {
+  while(received < n) {
+    sched_yield();
+  }
+}
+
+static void Bench(int batch) {
+  std::vector<int> fds(batch);
+  char payload[kPayload];
+  memset(payload, 0, sizeof(payload));
+  for (int i = 0; i < batch; i++) {
+    fds[i] = Connect();
+    // acceptされるまで待つ
+    long old = received;
+    kassert(write(fds[i], payload, sizeof(payload)) == sizeof(payload));
+    WaitReceived(old + 1);
+  }
+  long start_received = received;
+  long start_callbacks = callbacks;
+  uint64_t start = BenchNow();
+  for (int r = 0; r < kRounds; r++) {
+    for (int i = 0; i < batch; i++) {
+      kassert(write(fds[i], payload, sizeof(payload)) == sizeof(payload));
+    }
+    WaitReceived(start_received + static_cast<long>(batch) * (r + 1));
+  }
+  uint64_t elapsed = BenchNow() - start;
+  long n = received - start_received;
+  long c = callbacks - start_callbacks;
+  printf("rx batch %2d: %9.0f packets/s  %5.2f packets/callback\n",
+         batch, n * 1000000000.0 / elapsed, static_cast<double>(n) / c);
+  for (int i = 0; i < batch; i++) {
+    close(fds[i]);
+  }
+}
+
+static void Client() {
+  for (int batch = 1; batch <= kMaxBatch; batch *= 2) {
+    Bench(batch);
+  }
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  BenchSetup(BenchThreads(argc, argv));
+  port = kPortBase + getpid() % 10000;
+  sock = new PoolingSocket(port);
+  kassert(sock->Open() == 0);
+  Function func;
+  func.Init(Receive, nullptr);
+  sock->SetReceiveCallback(1, func);
+  // PollはCPU 0のタスクなので、mainのスレッドはCPU 0のワーカーとして動かし、
+  // 送る側は別のスレッドにする
+  std::thread client(Client);
+  task_ctrl->Run();
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// 一つのCPUが時々書き込む間に、他の全てのワーカーから読む時の、
+// SeqLockとSpinLockの読み込みスループットを測る
+// usage: seqlock [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時はオンラインのCPU数+1
+// CPU 1..N-1が読み、最後のワーカーが書く（ワーカーは2つ以上必要）
+
+#include "bench.h"
+#include <global.h>
+#include <seqlock.h>
+#include <spinlock.h>
+#include <vector>
+#include <stdio.h>
+
+static const int kReads = 1000 * 1000;
+// 書き込みの間隔（pauseの回数）
+static const int kWriteInterval = 10 * 1000;
+
+struct Snapshot {
+  long a;
+  long b;
+  long c;
+  long d;
+};
+
+static int workers;
+static SeqLock<Snapshot> *seqlock;
+static SpinLock snapshot_lock;
+static Snapshot snapshot;
+static volatile bool readers_done;
+static volatile long torn;
+
+static void ReadSeqLock(void *) {
+  BenchWaitStart();
+  for (int i = 0; i < kReads; i++) {
+    Snapshot s = seqlock->Read();
+    if (s.a != s.d) {
+      torn++;
+    }
+  }
+  BenchFinish();
+}
+
+static void ReadSpinLock(void *) {
+  BenchWaitStart();
+  for (int i = 0; i < kReads; i++) {
+    Snapshot s;
+    {
+      Locker locker(snapshot_lock);
+      s = snapshot;
+    }
+    if (s.a != s.d) {
+      torn++;
+    }
+  }
+  BenchFinish();
+}
+
+// 読み込みが終わるまで、時々書き込む
+static void Write(void *arg) {
+  bool use_seqlock = (arg != nullptr);
+  BenchWaitStart();
+  for (long i = 0; !readers_done; i++) {
+    Snapshot s = {i, i, i, i};
+    if (use_seqlock) {
+      seqlock->Write(s);
+    } else {
+      Locker locker(snapshot_lock);
+      snapshot = s;
+    }
+    for (int j = 0; j < kWriteInterval && !readers_done; j++) {
+      asm volatile("pause":::"memory");
+    }
+  }
+  BenchFinish();
+}
+
+static void Bench(const char *name, void (*reader)(void *), bool use_seqlock) {
+  int readers = workers - 1;
+  readers_done = false;
+  torn = 0;
+  BenchReset();
+  Task writer;
+  Function func;
+  func.Init(Write, use_seqlock ? reinterpret_cast<void *>(1) : nullptr);
+  writer.SetFunc(func);
+  task_ctrl->Register(workers, &writer);
+  // 書き込む側も揃えて始めるので、BenchRunOnWorkersは使わない
+  std::vector<Task> tasks(readers);
+  for (int i = 0; i < readers; i++) {
+    Function f;
+    f.Init(reader, nullptr);
+    tasks[i].SetFunc(f);
+    task_ctrl->Register(1 + i, &tasks[i]);
+  }
+  uint64_t start = BenchStart(readers + 1);
+  BenchWaitFinish(readers);
+  uint64_t elapsed = BenchNow() - start;
+  readers_done = true;
+  BenchWaitFinish(readers + 1);
+  for (int i = 0; i < readers; i++) {
+    BenchWaitTask(tasks[i]);
+  }
+  BenchWaitTask(writer);
+  kassert(torn == 0);
+  printf("seqlock %-8s %2d readers: %8.2f Mreads/s\n", name, readers,
+         static_cast<double>(kReads) * readers * 1000.0 / elapsed);
+}
+
+static void Driver() {
+  seqlock = new SeqLock<Snapshot>;
+  Bench("SeqLock", ReadSeqLock, true);
+  Bench("SpinLock", ReadSpinLock, false);
+  delete seqlock;
+}
+
+int main(int argc, char **argv) {
+  int threads = BenchThreads(argc, argv);
+  workers = threads - 1;
+  if (workers < 2) {
+    // make runを止めないよう、失敗にはしない
+    printf("seqlock: needs at least 2 workers\n");
+    return 0;
+  }
+  BenchSetup(threads);
+  BenchRun(Driver);
+  return 0;
+}
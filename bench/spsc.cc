@@ -0,0 +1,100 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+// 二つのCPUの間でピンポンした時の往復時間を、
+// SpscRingBufferとRingBufferで比べる
+// usage: spsc [threads]
+// threadsはPthreadCtrlのスレッド数で、省略時はオンラインのCPU数+1
+// CPU 1とCPU 2の間でやり取りする（ワーカーは2つ以上必要）
+
+#include "bench.h"
+#include <global.h>
+#include <buf.h>
+#include <stdio.h>
+#include <sched.h>
+
+static const int kPingPongs = 200 * 1000;
+// これだけ待っても来なければ、相手に譲る（同じコアで動いている時のため）
+static const int kSpinBeforeYield = 1000;
+
+template<class Ring>
+struct Arg {
+  Ring *ping;
+  Ring *pong;
+  bool initiator;
+};
+
+template<class Ring>
+static void PingPong(void *p) {
+  Arg<Ring> *arg = reinterpret_cast<Arg<Ring> *>(p);
+  BenchWaitStart();
+  for (long i = 0; i < kPingPongs; i++) {
+    long v;
+    if (arg->initiator) {
+      while(!arg->ping->Push(i)) {
+      }
+    }
+    for (int spin = 0; !arg->pong->Pop(v); spin++) {
+      if (spin >= kSpinBeforeYield) {
+        sched_yield();
+        spin = 0;
+      } else {
+        asm volatile("pause":::"memory");
+      }
+    }
+    kassert(v == i);
+    if (!arg->initiator) {
+      while(!arg->ping->Push(i)) {
+      }
+    }
+  }
+  BenchFinish();
+}
+
+template<class Ring>
+static void Bench(const char *name) {
+  Ring *a = new Ring;
+  Ring *b = new Ring;
+  Arg<Ring> args[2] = {{a, b, true}, {b, a, false}};
+  void *argp[2] = {&args[0], &args[1]};
+  uint64_t elapsed = BenchRunOnWorkers(2, PingPong<Ring>, argp);
+  printf("spsc %-14s: %8.1f ns/round trip\n", name, static_cast<double>(elapsed) / kPingPongs);
+  delete a;
+  delete b;
+}
+
+static void Driver() {
+  Bench<SpscRingBuffer<long, 64>>("SpscRingBuffer");
+  Bench<RingBuffer<long, 64>>("RingBuffer");
+}
+
+int main(int argc, char **argv) {
+  int threads = BenchThreads(argc, argv);
+  if (threads < 3) {
+    // make runを止めないよう、失敗にはしない
+    printf("spsc: needs at least 2 workers\n");
+    return 0;
+  }
+  BenchSetup(threads);
+  BenchRun(Driver);
+  return 0;
+}
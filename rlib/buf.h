@@ -63,6 +63,32 @@ class RingBuffer {
       return false;
     }
   }
+  // 入るだけ入れ、入れた数を返す
+  int PushBulk(const T *data, int n) {
+    Locker locker(_lock);
+    int space = (_head - _tail - 1 + S) % S;
+    if (n > space) {
+      n = space;
+    }
+    for (int i = 0; i < n; i++) {
+      _buffer[_tail] = data[i];
+      _tail = (_tail + 1) % S;
+    }
+    return n;
+  }
+  // 最大max個取り出し、取り出した数を返す
+  int PopBulk(T *data, int max) {
+    Locker locker(_lock);
+    int n = (_tail - _head + S) % S;
+    if (n > max) {
+      n = max;
+    }
+    for (int i = 0; i < n; i++) {
+      data[i] = _buffer[_head];
+      _head = (_head + 1) % S;
+    }
+    return n;
+  }
   bool IsFull() {
     Locker locker(_lock);
     int ntail = (_tail + 1) % S;
@@ -76,9 +102,13 @@ class RingBuffer {
   T _buffer[S];
   int _head;
   int _tail;
-  SpinLock _lock;
+  SpinLock _lock{_lock_profile};
+  static LockProfile _lock_profile;
 };
 
+template<class T, int S>
+LockProfile RingBuffer<T, S>::_lock_profile("RingBuffer");
+
 template<class T, int S>
   class FunctionalRingBuffer final : public Functional {
  public:
@@ -92,7 +122,24 @@ template<class T, int S>
     return flag;
   }
   bool Pop(T &data) {
-    return _buf.Pop(data);
+    if (!_buf.Pop(data)) {
+      return false;
+    }
+    Consume(1);
+    return true;
+  }
+  // 何個入れても、WakeupFunction()は一度しか呼ばない
+  int PushBulk(const T *data, int n) {
+    int pushed = _buf.PushBulk(data, n);
+    if (pushed != 0) {
+      WakeupFunction();
+    }
+    return pushed;
+  }
+  int PopBulk(T *data, int max) {
+    int popped = _buf.PopBulk(data, max);
+    Consume(popped);
+    return popped;
   }
   bool IsFull() {
     return _buf.IsFull();
@@ -107,5 +154,211 @@ template<class T, int S>
   RingBuffer<T, S> _buf;
 };
 
+// n以上の最小の2の冪
+static constexpr uint32_t RoundUpPow2(uint32_t n, uint32_t pow2 = 1) {
+  return (pow2 >= n) ? pow2 : RoundUpPow2(n, pow2 * 2);
+}
+
+// 一つのCPUだけがPushし、一つのCPUだけがPopする場合に使える、ロックを取らないRingBuffer
+// RingBufferと同じように使えるが、容量はSを2の冪に切り上げた数になる
+// IsFull()、IsEmpty()は、Push、Popする側以外から呼ぶと目安にしかならない
+template<class T, int S>
+class SpscRingBuffer {
+ public:
+  SpscRingBuffer() {
+  }
+  virtual ~SpscRingBuffer() {
+  }
+  // 満杯の時は何もせず、falseを返す
+  bool Push(T data) {
+    uint32_t tail = _tail;
+    if (tail - _cached_head == kSize) {
+      // 相手の添字は、足りなくなった時だけ読み直す
+      _cached_head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+      if (tail - _cached_head == kSize) {
+        return false;
+      }
+    }
+    _buffer[tail & kMask] = data;
+    __atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+  // 空の時は何もせず、falseを返す
+  bool Pop(T &data) {
+    uint32_t head = _head;
+    if (head == _cached_tail) {
+      _cached_tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+      if (head == _cached_tail) {
+        return false;
+      }
+    }
+    data = _buffer[head & kMask];
+    __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+  bool IsFull() {
+    return (__atomic_load_n(&_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&_head, __ATOMIC_ACQUIRE)) == kSize;
+  }
+  bool IsEmpty() {
+    return __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+  }
+ private:
+  static const uint32_t kSize = RoundUpPow2(S);
+  static const uint32_t kMask = kSize - 1;
+  // Pushする側とPopする側で別のキャッシュラインに置く
+  // 添字は剰余を取らずに増やし続け、参照する時にマスクする
+  uint32_t _tail __attribute__((aligned(64))) = 0;
+  uint32_t _cached_head = 0;
+  uint32_t _head __attribute__((aligned(64))) = 0;
+  uint32_t _cached_tail = 0;
+  T _buffer[kSize] __attribute__((aligned(64)));
+};
+
+// FunctionalRingBufferのSpscRingBuffer版
+template<class T, int S>
+  class FunctionalSpscRingBuffer final : public Functional {
+ public:
+  FunctionalSpscRingBuffer() {
+  }
+  ~FunctionalSpscRingBuffer() {
+  }
+  bool Push(T data) {
+    bool flag = _buf.Push(data);
+    // ロックを取らないので、積んだデータを見せてから起こす
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    WakeupFunction();
+    return flag;
+  }
+  bool Pop(T &data) {
+    if (!_buf.Pop(data)) {
+      return false;
+    }
+    Consume(1);
+    return true;
+  }
+  bool IsFull() {
+    return _buf.IsFull();
+  }
+  bool IsEmpty() {
+    return _buf.IsEmpty();
+  }
+ private:
+  virtual bool ShouldFunc() override {
+    return !_buf.IsEmpty();
+  }
+  SpscRingBuffer<T, S> _buf;
+};
+
+// 複数のCPUからPush、Popできる、ロックを取らないRingBuffer
+// 各要素が持つ番号で、その要素に書き込めるか、読み出せるかを判断する
+// RingBufferと同じように使えるが、容量はSを2の冪に切り上げた数になる
+template<class T, int S>
+class MpmcRingBuffer {
+ public:
+  MpmcRingBuffer() {
+    for (uint32_t i = 0; i < kSize; i++) {
+      _cells[i].seq = i;
+    }
+  }
+  virtual ~MpmcRingBuffer() {
+  }
+  // 満杯の時は何もせず、falseを返す
+  bool Push(T data) {
+    uint32_t pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+    Cell *cell;
+    while(true) {
+      cell = &_cells[pos & kMask];
+      int32_t diff = static_cast<int32_t>(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+      if (diff == 0) {
+        if (__sync_bool_compare_and_swap(&_enqueue_pos, pos, pos + 1)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // 一周前の要素がまだ読み出されていない
+        return false;
+      }
+      pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_RELAXED);
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+  // 空の時は何もせず、falseを返す
+  bool Pop(T &data) {
+    uint32_t pos = __atomic_load_n(&_dequeue_pos, __ATOMIC_RELAXED);
+    Cell *cell;
+    while(true) {
+      cell = &_cells[pos & kMask];
+      int32_t diff = static_cast<int32_t>(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+      if (diff == 0) {
+        if (__sync_bool_compare_and_swap(&_dequeue_pos, pos, pos + 1)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // まだ書き込まれていない
+        return false;
+      }
+      pos = __atomic_load_n(&_dequeue_pos, __ATOMIC_RELAXED);
+    }
+    data = cell->data;
+    __atomic_store_n(&cell->seq, pos + kSize, __ATOMIC_RELEASE);
+    return true;
+  }
+  // 他のCPUが操作中の時は目安にしかならない
+  bool IsFull() {
+    uint32_t pos = __atomic_load_n(&_enqueue_pos, __ATOMIC_ACQUIRE);
+    return static_cast<int32_t>(__atomic_load_n(&_cells[pos & kMask].seq, __ATOMIC_ACQUIRE) - pos) < 0;
+  }
+  // 書き込み途中の要素は空として扱う（書き込んだ側が後でFunctionalを起こす）
+  bool IsEmpty() {
+    uint32_t pos = __atomic_load_n(&_dequeue_pos, __ATOMIC_ACQUIRE);
+    return static_cast<int32_t>(__atomic_load_n(&_cells[pos & kMask].seq, __ATOMIC_ACQUIRE) - (pos + 1)) < 0;
+  }
+ private:
+  static const uint32_t kSize = RoundUpPow2(S < 2 ? 2 : S);
+  static const uint32_t kMask = kSize - 1;
+  struct Cell {
+    uint32_t seq;
+    T data;
+  };
+  uint32_t _enqueue_pos __attribute__((aligned(64))) = 0;
+  uint32_t _dequeue_pos __attribute__((aligned(64))) = 0;
+  Cell _cells[kSize] __attribute__((aligned(64)));
+};
+
+// FunctionalRingBufferのMpmcRingBuffer版
+template<class T, int S>
+  class FunctionalMpmcRingBuffer final : public Functional {
+ public:
+  FunctionalMpmcRingBuffer() {
+  }
+  ~FunctionalMpmcRingBuffer() {
+  }
+  bool Push(T data) {
+    bool flag = _buf.Push(data);
+    // ロックを取らないので、積んだデータを見せてから起こす
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    WakeupFunction();
+    return flag;
+  }
+  bool Pop(T &data) {
+    if (!_buf.Pop(data)) {
+      return false;
+    }
+    Consume(1);
+    return true;
+  }
+  bool IsFull() {
+    return _buf.IsFull();
+  }
+  bool IsEmpty() {
+    return _buf.IsEmpty();
+  }
+ private:
+  virtual bool ShouldFunc() override {
+    return !_buf.IsEmpty();
+  }
+  MpmcRingBuffer<T, S> _buf;
+};
 
 #endif /* __RAPH_KERNEL_BUF_H__ */
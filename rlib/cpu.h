@@ -32,6 +32,17 @@ public:
   bool IsValidId(int cpuid) {
     return (cpuid >= 0 && cpuid < GetHowManyCpus());
   }
+  // 値が等しいCPU同士は、それぞれコア(SMT)、最後段のキャッシュ、NUMAノードを共有する
+  // 分からない時は、全て別のコア・キャッシュで、同じノードにあるものとして扱う
+  virtual int GetCoreId(int cpuid) {
+    return cpuid;
+  }
+  virtual int GetCacheDomainId(int cpuid) {
+    return cpuid;
+  }
+  virtual int GetNodeId(int cpuid) {
+    return 0;
+  }
 };
 
 #ifdef __KERNEL__
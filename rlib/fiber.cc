@@ -0,0 +1,258 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#include <fiber.h>
+#include <cpu.h>
+#include <raph.h>
+#include <mem/virtmem.h>
+
+// 呼び出し先保存レジスタをスタックに積み、スタックを切り替える
+// void fiber_switch(void **save, void *load)
+extern "C" void fiber_switch(void **save, void *load);
+// 新しいスタックで最初に戻る先
+// r12にFiber、r13にFiber::Entryが入っている
+extern "C" void fiber_trampoline();
+
+asm(".text\n"
+    ".globl fiber_switch\n"
+    ".type fiber_switch, @function\n"
+    "fiber_switch:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".globl fiber_trampoline\n"
+    ".type fiber_trampoline, @function\n"
+    "fiber_trampoline:\n"
+    "  movq %r12, %rdi\n"
+    "  call *%r13\n"
+    "  ud2\n");
+
+Fiber::CpuLocal *Fiber::_cpu_local = nullptr;
+LockProfile FiberQueue::_lock_profile("FiberQueue");
+
+Fiber::~Fiber() {
+  kassert(IsFinished());
+}
+
+void Fiber::Start(int cpuid) {
+  kassert(_state == State::kStopped);
+  _cpuid = cpuid;
+  _finished = false;
+  _notified = false;
+  _state = State::kRunnable;
+  task_ctrl->Register(cpuid, &_task);
+}
+
+void Fiber::Yield() {
+  kassert(GetCurrent() == this);
+  _state = State::kRunnable;
+  // 実行中のタスクは、このCPUでは中断するまで取り出されない
+  task_ctrl->Register(_cpuid, &_task);
+  Suspend();
+}
+
+void Fiber::SleepUs(int us) {
+  kassert(GetCurrent() == this);
+  _state = State::kSleeping;
+  _callout.SetHandler(_cpuid, us);
+  Suspend();
+}
+
+void Fiber::Wait() {
+  kassert(GetCurrent() == this);
+  _state = State::kWaiting;
+  __sync_synchronize();
+  // Wakeup()と同時の場合は、どちらか一方だけが状態を変えられる
+  if (!_notified || !__sync_bool_compare_and_swap(&_state, State::kWaiting, State::kRunning)) {
+    Suspend();
+  }
+  _notified = false;
+}
+
+void Fiber::Wakeup() {
+  _notified = true;
+  __sync_synchronize();
+  if (__sync_bool_compare_and_swap(&_state, State::kWaiting, State::kRunnable)) {
+    task_ctrl->Register(_cpuid, &_task);
+  }
+}
+
+Fiber *Fiber::GetCurrent() {
+  if (_cpu_local == nullptr) {
+    return nullptr;
+  }
+  return _cpu_local[cpu_ctrl->GetId()].current;
+}
+
+Fiber::CpuLocal *Fiber::GetCpuLocal() {
+  if (_cpu_local == nullptr) {
+    int cpus = cpu_ctrl->GetHowManyCpus();
+    CpuLocal *local = reinterpret_cast<CpuLocal *>(virtmem_ctrl->AllocZ(sizeof(CpuLocal) * cpus));
+    if (!__sync_bool_compare_and_swap(&_cpu_local, nullptr, local)) {
+      virtmem_ctrl->Free(reinterpret_cast<virt_addr>(local));
+    }
+  }
+  return &_cpu_local[cpu_ctrl->GetId()];
+}
+
+void Fiber::HandleSub(void *) {
+  CpuLocal &local = *GetCpuLocal();
+  kassert(local.current == nullptr);
+  if (_stack == nullptr) {
+    _stack = AllocStack(local);
+    // fiber_switchが積むレジスタと戻り先を用意しておく
+    // trampolineに入った時にスタックが16byte境界に揃うようにする
+    uint64_t *sp = reinterpret_cast<uint64_t *>(reinterpret_cast<uint8_t *>(_stack) + kStackSize);
+    *(--sp) = 0;
+    *(--sp) = 0;
+    *(--sp) = reinterpret_cast<uint64_t>(fiber_trampoline);
+    *(--sp) = 0;                                      // rbp
+    *(--sp) = 0;                                      // rbx
+    *(--sp) = reinterpret_cast<uint64_t>(this);       // r12
+    *(--sp) = reinterpret_cast<uint64_t>(&Fiber::Entry); // r13
+    *(--sp) = 0;                                      // r14
+    *(--sp) = 0;                                      // r15
+    _context = sp;
+  }
+
+  local.current = this;
+  _state = State::kRunning;
+  fiber_switch(&_sched_context, _context);
+  local.current = nullptr;
+
+  if (_finished) {
+    FreeStack(local, _stack);
+    _stack = nullptr;
+    _state = State::kStopped;
+  }
+}
+
+void Fiber::HandleCallout(void *) {
+  if (__sync_bool_compare_and_swap(&_state, State::kSleeping, State::kRunnable)) {
+    task_ctrl->Register(_cpuid, &_task);
+  }
+}
+
+void Fiber::Suspend() {
+  fiber_switch(&_context, _sched_context);
+}
+
+void Fiber::Entry(Fiber *that) {
+  that->_func.Execute();
+  that->_finished = true;
+  that->Suspend();
+  kassert(false);
+}
+
+void *Fiber::AllocStack(CpuLocal &local) {
+  if (local.stack_pool != nullptr) {
+    void *stack = local.stack_pool;
+    local.stack_pool = *reinterpret_cast<void **>(stack);
+    local.stack_pool_cnt--;
+    return stack;
+  }
+  return reinterpret_cast<void *>(virtmem_ctrl->Alloc(kStackSize));
+}
+
+void Fiber::FreeStack(CpuLocal &local, void *stack) {
+  if (local.stack_pool_cnt >= kStackPoolSize) {
+    virtmem_ctrl->Free(reinterpret_cast<virt_addr>(stack));
+    return;
+  }
+  *reinterpret_cast<void **>(stack) = local.stack_pool;
+  local.stack_pool = stack;
+  local.stack_pool_cnt++;
+}
+
+void FiberQueue::Push(void *data) {
+  _queue.Push(data);
+  Fiber *fiber;
+  {
+    Locker locker(_lock);
+    fiber = _waiter_first;
+    if (fiber == nullptr) {
+      return;
+    }
+    _waiter_first = fiber->_wait_next;
+    if (_waiter_first == nullptr) {
+      _waiter_last = nullptr;
+    }
+  }
+  fiber->Wakeup();
+}
+
+void FiberQueue::Pop(void *&data) {
+  Fiber *self = Fiber::GetCurrent();
+  kassert(self != nullptr);
+  while(!_queue.Pop(data)) {
+    {
+      Locker locker(_lock);
+      // Pushはデータを積んでからロックを取るので、ここで空ならWakeupされる
+      if (!_queue.IsEmpty()) {
+        continue;
+      }
+      self->_wait_next = nullptr;
+      if (_waiter_last == nullptr) {
+        _waiter_first = self;
+      } else {
+        _waiter_last->_wait_next = self;
+      }
+      _waiter_last = self;
+    }
+    self->Wait();
+    {
+      // 他の理由でWakeupされた時は、まだ繋がっている
+      Locker locker(_lock);
+      RemoveWaiter(self);
+    }
+  }
+}
+
+void FiberQueue::RemoveWaiter(Fiber *fiber) {
+  Fiber *prev = nullptr;
+  for (Fiber *f = _waiter_first; f != nullptr; f = f->_wait_next) {
+    if (f == fiber) {
+      if (prev == nullptr) {
+        _waiter_first = f->_wait_next;
+      } else {
+        prev->_wait_next = f->_wait_next;
+      }
+      if (_waiter_last == f) {
+        _waiter_last = prev;
+      }
+      return;
+    }
+    prev = f;
+  }
+}
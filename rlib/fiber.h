@@ -0,0 +1,150 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#ifndef __RAPH_LIB_FIBER_H__
+#define __RAPH_LIB_FIBER_H__
+
+#include <task.h>
+#include <queue.h>
+#include <spinlock.h>
+#include <function.h>
+
+// 自身のスタックを持ち、途中で中断できるタスク
+// Yield()、SleepUs()、Wait()、FiberQueue::Pop()で中断し、
+// 後でスケジューラから同じCPU上で再開される
+// 中断中もTaskとして扱われるので、IsFinished()が真になるまでは破棄してはいけない
+class Fiber {
+public:
+  enum class State {
+    // 開始前、または終了した
+    kStopped,
+    // キューで実行を待っている
+    kRunnable,
+    kRunning,
+    kSleeping,
+    kWaiting,
+  };
+  Fiber() {
+    ClassFunction<Fiber> func;
+    func.Init(this, &Fiber::HandleSub, nullptr);
+    _task.SetFunc(func);
+    // スタックはCPUごとに使い回すので、他のCPUには移さない
+    _task.SetPinned(true);
+    ClassFunction<Fiber> cfunc;
+    cfunc.Init(this, &Fiber::HandleCallout, nullptr);
+    _callout.Init(cfunc);
+  }
+  virtual ~Fiber();
+  void Init(const GenericFunction &func) {
+    _func.Copy(func);
+  }
+  // cpuid上で実行を開始する
+  void Start(int cpuid);
+  State GetState() {
+    return _state;
+  }
+  // 終了した（または開始前の）Fiberを、スケジューラも手放したか
+  // kStoppedになるのはまだタスクの実行中なので、タスクが外れるまで待つ必要がある
+  bool IsFinished() {
+    return _state == State::kStopped && _task.GetStatus() == Task::Status::kOutOfQueue;
+  }
+
+  // 以下の4つは、このFiber上からのみ呼び出せる
+  // 他のタスクを実行してから再開する
+  void Yield();
+  void SleepUs(int us);
+  // Wakeup()されるまで中断する
+  // 先にWakeup()されていた場合はすぐに戻るが、複数回のWakeup()は一回にまとめられるので、
+  // 待っていた条件は戻った後に確認し直す事
+  void Wait();
+
+  // 割り込み内からも呼び出し可能
+  void Wakeup();
+
+  // 実行中のFiber（Fiber上でなければnullptr）
+  static Fiber *GetCurrent();
+
+  static const size_t kStackSize = 64 * 1024;
+private:
+  struct CpuLocal {
+    Fiber *current;
+    // 使い終わったスタックを、先頭に次のスタックへのポインタを書いて繋いでおく
+    void *stack_pool;
+    int stack_pool_cnt;
+  };
+  static CpuLocal *GetCpuLocal();
+  void HandleSub(void *);
+  void HandleCallout(void *);
+  // スケジューラに戻る
+  void Suspend();
+  static void Entry(Fiber *that);
+  void *AllocStack(CpuLocal &local);
+  void FreeStack(CpuLocal &local, void *stack);
+  Task _task;
+  Callout _callout;
+  FunctionBase _func;
+  int _cpuid;
+  volatile State _state = State::kStopped;
+  volatile bool _notified = false;
+  bool _finished;
+  void *_stack = nullptr;
+  // 中断中のFiberと、Fiberを実行中のスケジューラのスタックポインタ
+  void *_context;
+  void *_sched_context;
+  // for FiberQueue
+  Fiber *_wait_next;
+  friend class FiberQueue;
+
+  // CPUごとに取っておくスタックの数
+  static const int kStackPoolSize = 16;
+  static CpuLocal *_cpu_local;
+};
+
+// Fiberから待つ事ができるQueue
+class FiberQueue {
+public:
+  FiberQueue() {
+  }
+  virtual ~FiberQueue() {
+  }
+  // 割り込み内からは呼び出せない
+  void Push(void *data);
+  // 空の時はPushされるまで中断する
+  // Fiber上からのみ呼び出せる
+  void Pop(void *&data);
+  // 空の時はfalseが帰る
+  bool TryPop(void *&data) {
+    return _queue.Pop(data);
+  }
+  bool IsEmpty() {
+    return _queue.IsEmpty();
+  }
+private:
+  void RemoveWaiter(Fiber *fiber);
+  Queue _queue;
+  SpinLock _lock{_lock_profile};
+  static LockProfile _lock_profile;
+  Fiber *_waiter_first = nullptr;
+  Fiber *_waiter_last = nullptr;
+};
+
+#endif /* __RAPH_LIB_FIBER_H__ */
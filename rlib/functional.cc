@@ -28,23 +28,41 @@ void Functional::WakeupFunction() {
   if (!_func.CanExecute()) {
     return;
   }
-  Locker locker(_lock);
-  if (_state == FunctionState::kFunctioning) {
+  // 既に登録済みなら、読み出し一回で済ませる
+  if (__atomic_load_n(&_state, __ATOMIC_ACQUIRE) == FunctionState::kFunctioning) {
     return;
   }
-  _state = FunctionState::kFunctioning;
-  task_ctrl->Register(_cpuid, &_task);
+  if (__sync_bool_compare_and_swap(&_state, FunctionState::kNotFunctioning, FunctionState::kFunctioning)) {
+    task_ctrl->Register(_cpuid, &_task);
+  }
 }
 
 void Functional::Handle(void *p) {
   Functional *that = reinterpret_cast<Functional *>(p);
-  if (that->ShouldFunc()) {
+  Budget budget = that->_budget;
+  uint64_t end = 0;
+  if (budget.us != 0) {
+    end = timer->GetCntAfterPeriod(timer->ReadMainCnt(), budget.us);
+  }
+  that->_remaining = budget.count;
+  while (that->_remaining > 0 && that->ShouldFunc()) {
+    int remaining = that->_remaining;
     that->_func.Execute();
+    // 何も取り出さない関数でも、必ず上限に近づける
+    if (that->_remaining == remaining) {
+      that->_remaining--;
+    }
+    if (budget.us != 0 && timer->IsTimePassed(end)) {
+      break;
+    }
   }
-  {
-    Locker locker(that->_lock);
-    if (!that->ShouldFunc()) {
-      that->_state = FunctionState::kNotFunctioning;
+  if (!that->ShouldFunc()) {
+    __atomic_store_n(&that->_state, FunctionState::kNotFunctioning, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // 状態を戻す前に積まれたデータを見落とさないよう、もう一度確認する
+    // 既に他のCPUが登録し直していれば何もしない
+    if (!that->ShouldFunc() ||
+        !__sync_bool_compare_and_swap(&that->_state, FunctionState::kNotFunctioning, FunctionState::kFunctioning)) {
       return;
     }
   }
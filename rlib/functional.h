@@ -40,17 +40,44 @@ class Functional {
   virtual ~Functional() {
   }
   void SetFunction(int cpuid, const GenericFunction &func);
+  // 一度タスクとして実行された時に、取り出す要素数と時間(us)の上限
+  // ShouldFunc()が真の間は上限まで続けて関数を呼び出し、残りは登録し直して他のタスクに譲る
+  // 何も取り出さなかった呼び出しは一要素と数える
+  // usが0なら時間では区切らない
+  struct Budget {
+    int count;
+    int us;
+  };
+  void SetBudget(const Budget &budget) {
+    kassert(budget.count > 0 && budget.us >= 0);
+    _budget = budget;
+  }
+  // 関数の中から呼び、今回のタスク実行で後何要素取り出せるかを返す
+  // PopBulk()で取り出す数をこれで抑えれば、countを超えない
+  int GetRemainingBudget() {
+    return _remaining > 0 ? _remaining : 0;
+  }
  protected:
+  // 呼ぶ前に積んだデータが、ShouldFunc()から見えている必要がある
+  // （ShouldFunc()と同じロックで積むか、メモリバリアを置く事）
+  // そうでないと、Handle()が状態を戻す時に見落とし、起こし損ねる
   void WakeupFunction();
   // check whether Functional needs to process function
   virtual bool ShouldFunc() = 0;
+  // 取り出した要素数を予算から引く
+  // Handle()の外から取り出しても、次のHandle()で戻るので構わない
+  void Consume(int n) {
+    _remaining -= n;
+  }
  private:
   static void Handle(void *p);
   FunctionBase _func;
   Task _task;
   int _cpuid = 0;
-  SpinLock _lock;
-  FunctionState _state = FunctionState::kNotFunctioning;
+  Budget _budget = {1, 0};
+  int _remaining = 0;
+  // kNotFunctioningからkFunctioningに変えたCPUだけがタスクを登録する
+  volatile FunctionState _state = FunctionState::kNotFunctioning;
 };
 
 #endif // __RAPH_KERNEL_FUNCTIONAL_H__
@@ -139,6 +139,10 @@ void PoolingSocket::Poll(void *arg) {
     }
   }
 
+  // 受信したパケットは最後にまとめて積み、受信コールバックは一度だけ起こす
+  Packet *received[kMaxClientNumber + 1];
+  int received_num = 0;
+
   {
     // TCP receive sequence
     Packet *packet;
@@ -160,7 +164,7 @@ void PoolingSocket::Poll(void *arg) {
             if (rval > 0) {
               packet->adr = i;
               packet->len = rval;
-              _rx_buffered.Push(packet);
+              received[received_num++] = packet;
             } else {
               if (rval == 0) {
                 // socket may be closed by foreign host
@@ -195,7 +199,7 @@ void PoolingSocket::Poll(void *arg) {
 
         RefreshTtl();
 
-        _rx_buffered.Push(packet);
+        received[received_num++] = packet;
       } else {
         ReuseRxBuffer(packet);
 
@@ -206,6 +210,14 @@ void PoolingSocket::Poll(void *arg) {
     }
   }
 
+  if (received_num != 0) {
+    int pushed = _rx_buffered.PushBulk(received, received_num);
+    if (pushed != received_num) {
+      // 積めなかった分は捨てて、バッファを戻す
+      ReuseRxBuffers(received + pushed, received_num - pushed);
+    }
+  }
+
   {
     // transmit sequence
     Packet *packet;
@@ -50,6 +50,14 @@ public:
   virtual void SetReceiveCallback(int cpuid, const Function &func) override {
     _rx_buffered.SetFunction(cpuid, func);
   }
+  // 受信コールバックを一度のタスク実行で呼び出す回数と時間の上限
+  void SetReceiveBudget(const Functional::Budget &budget) {
+    _rx_buffered.SetBudget(budget);
+  }
+  // 受信コールバックの中で、後何個のパケットを受け取れるかを返す
+  int GetReceiveBudget() {
+    return _rx_buffered.GetRemainingBudget();
+  }
 
   // pass 32bit-converted IP address to 1st-arg (use inet_addr)
   // return value is client number, but
@@ -86,6 +94,13 @@ public:
   bool ReceivePacket(Packet *&packet) {
     return _rx_buffered.Pop(packet);
   }
+  // 最大max個のパケットをまとめて受け取り、受け取った数を返す
+  int ReceivePackets(Packet **packets, int max) {
+    return _rx_buffered.PopBulk(packets, max);
+  }
+  void ReuseRxBuffers(Packet **packets, int n) {
+    kassert(_rx_reserved.PushBulk(packets, n) == n);
+  }
 
 private:
   static const uint32_t kPoolDepth = 300;
@@ -0,0 +1,115 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#include <parallel.h>
+#include <cpu.h>
+#include <raph.h>
+#include <mem/virtmem.h>
+
+ParallelJob::Helper **ParallelJob::_helper_pool = nullptr;
+
+void ParallelJob::Run() {
+  int cpuid = cpu_ctrl->GetId();
+  int cpus = cpu_ctrl->GetHowManyCpus();
+  int64_t chunks = (_end - _next + _grain - 1) / _grain;
+  int helpers_num = (chunks - 1 < cpus - 1) ? chunks - 1 : cpus - 1;
+  if (helpers_num <= 0) {
+    Work();
+    return;
+  }
+
+  Helper *helpers = nullptr;
+  for (int i = 1; i < cpus && helpers_num > 0; i++) {
+    int target = (cpuid + i) % cpus;
+    if (!task_ctrl->IsActive(target)) {
+      continue;
+    }
+    helpers_num--;
+    Helper *helper = AllocHelper(cpuid);
+    helper->job = this;
+    __sync_synchronize();
+    helper->state = Helper::State::kPending;
+    helper->next = helpers;
+    helpers = helper;
+    __sync_fetch_and_add(&_running, 1);
+    task_ctrl->Register(target, &helper->task);
+  }
+
+  Work();
+
+  // チャンクは全て取り出されたので、まだ始まっていないHelperは待たずに取り消す
+  // (他のCPUも同じように待っている場合に、互いを待ち続けないようにする)
+  for (Helper *helper = helpers; helper != nullptr; helper = helper->next) {
+    if (__sync_bool_compare_and_swap(&helper->state, Helper::State::kPending, Helper::State::kCancelled)) {
+      __sync_fetch_and_sub(&_running, 1);
+    }
+  }
+  while(_running != 0) {
+    asm volatile("pause":::"memory");
+  }
+
+  while(helpers != nullptr) {
+    Helper *next = helpers->next;
+    FreeHelper(cpuid, helpers);
+    helpers = next;
+  }
+}
+
+void ParallelJob::HandleHelper(void *p) {
+  Helper *helper = reinterpret_cast<Helper *>(p);
+  if (!__sync_bool_compare_and_swap(&helper->state, Helper::State::kPending, Helper::State::kStarted)) {
+    return;
+  }
+  ParallelJob *job = helper->job;
+  job->Work();
+  __sync_fetch_and_sub(&job->_running, 1);
+}
+
+// Helperは確保したCPUでしか使わないので、ロックは要らない
+ParallelJob::Helper *ParallelJob::AllocHelper(int cpuid) {
+  if (_helper_pool == nullptr) {
+    int cpus = cpu_ctrl->GetHowManyCpus();
+    Helper **pool = reinterpret_cast<Helper **>(virtmem_ctrl->AllocZ(sizeof(Helper *) * cpus));
+    if (!__sync_bool_compare_and_swap(&_helper_pool, nullptr, pool)) {
+      virtmem_ctrl->Free(reinterpret_cast<virt_addr>(pool));
+    }
+  }
+  Helper *helper = _helper_pool[cpuid];
+  if (helper != nullptr) {
+    _helper_pool[cpuid] = helper->next;
+    return helper;
+  }
+  helper = reinterpret_cast<Helper *>(virtmem_ctrl->Alloc(sizeof(Helper)));
+  new(helper) Helper;
+  helper->state = Helper::State::kCancelled;
+  Function func;
+  func.Init(HandleHelper, reinterpret_cast<void *>(helper));
+  helper->task.SetFunc(func);
+  return helper;
+}
+
+// 取り消されたHelperのタスクはまだキューに残っている事があるが、
+// 次に使う時にRegisterしても二重には積まれず、一度だけ実行される
+void ParallelJob::FreeHelper(int cpuid, Helper *helper) {
+  helper->next = _helper_pool[cpuid];
+  _helper_pool[cpuid] = helper;
+}
@@ -0,0 +1,137 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#ifndef __RAPH_LIB_PARALLEL_H__
+#define __RAPH_LIB_PARALLEL_H__
+
+#include <stdint.h>
+#include <task.h>
+#include <spinlock.h>
+
+// 範囲をgrainずつのチャンクに分け、呼び出し元のCPUと他のCPUで分担して処理する
+// 呼び出し元もチャンクを処理し、全てのチャンクが終わるまで戻らない
+// TaskCtrlのタスク内（割り込み外）から呼び出す事
+class ParallelJob {
+public:
+  ParallelJob(int64_t begin, int64_t end, int64_t grain) {
+    _next = begin;
+    _end = end;
+    _grain = grain > 0 ? grain : 1;
+  }
+  virtual ~ParallelJob() {
+  }
+  void Run();
+protected:
+  // 次のチャンクを取り出す。残っていなければfalseが帰る
+  bool GetChunk(int64_t &begin, int64_t &end) {
+    begin = __sync_fetch_and_add(&_next, _grain);
+    if (begin >= _end) {
+      return false;
+    }
+    end = (_end - begin > _grain) ? begin + _grain : _end;
+    return true;
+  }
+  // チャンクが無くなるまで処理する
+  // 処理に参加するCPUごとに一度ずつ呼ばれる
+  virtual void Work() = 0;
+private:
+  // 他のCPUでWork()を呼ぶタスク
+  // まだキューに繋がっている間に再利用される事があるので、破棄せずにCPUごとに使い回す
+  struct Helper {
+    enum class State {
+      kPending,
+      kStarted,
+      kCancelled,
+    };
+    Task task;
+    ParallelJob *job;
+    volatile State state;
+    Helper *next;
+  };
+  static void HandleHelper(void *p);
+  static Helper *AllocHelper(int cpuid);
+  static void FreeHelper(int cpuid, Helper *helper);
+  volatile int64_t _next;
+  int64_t _end;
+  int64_t _grain;
+  // 実行中のHelperの数
+  volatile int _running = 0;
+  static Helper **_helper_pool;
+};
+
+template <class F>
+class ParallelForJob final : public ParallelJob {
+public:
+  ParallelForJob(int64_t begin, int64_t end, int64_t grain, const F &body) : ParallelJob(begin, end, grain), _body(body) {
+  }
+private:
+  virtual void Work() override {
+    int64_t begin, end;
+    while(GetChunk(begin, end)) {
+      _body(begin, end);
+    }
+  }
+  const F &_body;
+};
+
+template <class T, class F, class R>
+class ParallelReduceJob final : public ParallelJob {
+public:
+  ParallelReduceJob(int64_t begin, int64_t end, int64_t grain, const T &identity, const F &body, const R &reduce) : ParallelJob(begin, end, grain), _identity(identity), _result(identity), _body(body), _reduce(reduce) {
+  }
+  T GetResult() {
+    return _result;
+  }
+private:
+  virtual void Work() override {
+    T local = _identity;
+    int64_t begin, end;
+    while(GetChunk(begin, end)) {
+      local = _reduce(local, _body(begin, end));
+    }
+    Locker locker(_lock);
+    _result = _reduce(_result, local);
+  }
+  const T _identity;
+  T _result;
+  const F &_body;
+  const R &_reduce;
+  SpinLock _lock;
+};
+
+// [begin, end)について、body(chunk_begin, chunk_end)を並列に実行する
+template <class F>
+void ParallelFor(int64_t begin, int64_t end, int64_t grain, const F &body) {
+  ParallelForJob<F> job(begin, end, grain, body);
+  job.Run();
+}
+
+// [begin, end)について、body(chunk_begin, chunk_end)の結果をreduce(a, b)で畳み込む
+// 畳み込む順番は決まっていないので、reduceは結合的かつ可換である事
+template <class T, class F, class R>
+T ParallelReduce(int64_t begin, int64_t end, int64_t grain, const T &identity, const F &body, const R &reduce) {
+  ParallelReduceJob<T, F, R> job(begin, end, grain, identity, body, reduce);
+  job.Run();
+  return job.GetResult();
+}
+
+#endif /* __RAPH_LIB_PARALLEL_H__ */
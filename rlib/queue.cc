@@ -25,6 +25,8 @@
 #include <mem/virtmem.h>
 #include <raph.h>
 
+LockProfile Queue::_lock_profile("Queue");
+
 void Queue::Push(void *data) {
   Container *c = reinterpret_cast<Container *>(virtmem_ctrl->Alloc(sizeof(Container)));
   c->data = data;
@@ -39,7 +41,7 @@ bool Queue::Pop(void *&data) {
   Container *c;
   {
     Locker locker(_lock);
-    if (IsEmpty()) {
+    if (&_first == _last) {
       return false;
     }
     c = _first.next;
@@ -37,7 +37,9 @@ class Queue {
   void Push(void *data);
   // 空の時はfalseが帰る
   bool Pop(void *&data);
+  // Pushと同じロックを取るので、FunctionalQueueのShouldFunc()から使える
   bool IsEmpty() {
+    Locker locker(_lock);
     return &_first == _last;
   }
  private:
@@ -47,7 +49,8 @@ class Queue {
   };
   Container _first;
   Container *_last;
-  SpinLock _lock;
+  SpinLock _lock{_lock_profile};
+  static LockProfile _lock_profile;
 };
 
 class FunctionalQueue final : public Functional {
@@ -61,7 +64,11 @@ class FunctionalQueue final : public Functional {
     WakeupFunction();
   }
   bool Pop(void *&data) {
-    return _queue.Pop(data);
+    if (!_queue.Pop(data)) {
+      return false;
+    }
+    Consume(1);
+    return true;
   }
   bool IsEmpty() {
     return _queue.IsEmpty();
@@ -73,4 +80,89 @@ class FunctionalQueue final : public Functional {
   Queue _queue;
 };
 
+// 要素自身にリンクを持たせる事で、Push時にメモリを確保しないQueue
+// 要素はIntrusiveQueue<T>::Containerを継承する必要がある
+// 一つの要素を同時に複数のキューに入れてはいけない
+template<class T>
+class IntrusiveQueue {
+ public:
+  class Container {
+  public:
+    Container() {
+      _next = nullptr;
+    }
+  private:
+    Container *_next;
+    friend IntrusiveQueue;
+  };
+  IntrusiveQueue() {
+    _last = &_first;
+  }
+  virtual ~IntrusiveQueue() {
+  }
+  void Push(T *data) {
+    Container *c = data;
+    c->_next = nullptr;
+    Locker locker(_lock);
+    kassert(_last->_next == nullptr);
+    _last->_next = c;
+    _last = c;
+  }
+  // 空の時はfalseが帰る
+  bool Pop(T *&data) {
+    Locker locker(_lock);
+    if (&_first == _last) {
+      return false;
+    }
+    Container *c = _first._next;
+    kassert(c != nullptr);
+    _first._next = c->_next;
+    if (_last == c) {
+      _last = &_first;
+    }
+    data = static_cast<T *>(c);
+    return true;
+  }
+  bool IsEmpty() {
+    Locker locker(_lock);
+    return &_first == _last;
+  }
+ private:
+  Container _first;
+  Container *_last;
+  SpinLock _lock{_lock_profile};
+  static LockProfile _lock_profile;
+};
+
+template<class T>
+LockProfile IntrusiveQueue<T>::_lock_profile("IntrusiveQueue");
+
+template<class T>
+class FunctionalIntrusiveQueue final : public Functional {
+ public:
+  FunctionalIntrusiveQueue() {
+  }
+  ~FunctionalIntrusiveQueue() {
+  }
+  void Push(T *data) {
+    _queue.Push(data);
+    WakeupFunction();
+  }
+  bool Pop(T *&data) {
+    if (!_queue.Pop(data)) {
+      return false;
+    }
+    Consume(1);
+    return true;
+  }
+  bool IsEmpty() {
+    return _queue.IsEmpty();
+  }
+ private:
+  virtual bool ShouldFunc() override {
+    return !_queue.IsEmpty();
+  }
+  IntrusiveQueue<T> _queue;
+};
+
 #endif // __RAPH_KERNEL_RAPHQUEUE_H__
@@ -0,0 +1,86 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#ifndef __RAPH_LIB_SEQLOCK_H__
+#define __RAPH_LIB_SEQLOCK_H__
+
+#include <spinlock.h>
+
+// 読み込みが多く、書き込みが稀な小さいデータ向けのシーケンスロック
+// 読み込み側は何も書き込まず、読んでいる間に書き込みがあれば読み直す
+// 読み込み中に書き換えられた値を一時的に読む事があるので、Tはポインタを含まない単純なデータに限る
+// (x86のメモリ順序を前提にしている)
+template <class T>
+class SeqLock {
+public:
+  SeqLock() {
+  }
+  SeqLock(const T &value) : _value(value) {
+  }
+  ~SeqLock() {
+  }
+  T Read() {
+    T value;
+    unsigned int seq;
+    do {
+      seq = ReadBegin();
+      value = _value;
+    } while(ReadRetry(seq));
+    return value;
+  }
+  // 書き込み側同士はロックで排他する
+  // 割り込みハンドラ内では使えないので注意
+  void Write(const T &value) {
+    Locker locker(_lock);
+    _seq++;
+    asm volatile("":::"memory");
+    _value = value;
+    asm volatile("":::"memory");
+    _seq++;
+  }
+  // 一部だけを読む時などは、ReadBegin()とReadRetry()の間で直接読み、
+  // ReadRetry()がtrueなら読み直す
+  unsigned int ReadBegin() {
+    while(true) {
+      unsigned int seq = _seq;
+      // 奇数の時は書き込み中
+      if ((seq % 2) == 0) {
+        asm volatile("":::"memory");
+        return seq;
+      }
+      asm volatile("pause":::"memory");
+    }
+  }
+  bool ReadRetry(unsigned int seq) {
+    asm volatile("":::"memory");
+    return _seq != seq;
+  }
+  const T &GetRaw() {
+    return _value;
+  }
+private:
+  volatile unsigned int _seq = 0;
+  T _value;
+  SpinLock _lock;
+};
+
+#endif // __RAPH_LIB_SEQLOCK_H__
@@ -30,6 +30,11 @@
 #include <apic.h>
 #endif // __KERNEL__
 
+#ifdef __LOCK_PROFILE__
+#include <tty.h>
+#include <mem/virtmem.h>
+#endif // __LOCK_PROFILE__
+
 void SpinLock::Lock() {
 #ifdef __KERNEL__
   kassert(idt->GetHandlingCnt() == 0);
@@ -37,11 +42,22 @@ void SpinLock::Lock() {
   if ((_flag % 2) == 1) {
     kassert(_id != cpu_ctrl->GetId());
   }
+#ifdef __LOCK_PROFILE__
+  uint64_t start = LockProfile::ReadTsc();
+  uint64_t spins = 0;
+#endif // __LOCK_PROFILE__
   volatile unsigned int flag = GetFlag();
   while((flag % 2) == 1 || !SetFlag(flag, flag + 1)) {
+#ifdef __LOCK_PROFILE__
+    spins++;
+#endif // __LOCK_PROFILE__
     flag = GetFlag();
   }
   _id = cpu_ctrl->GetId();
+#ifdef __LOCK_PROFILE__
+  _acquired = LockProfile::ReadTsc();
+  _profile->RecordAcquire(_id, spins, _acquired - start);
+#endif // __LOCK_PROFILE__
 }
 
 void DebugSpinLock::Lock() {
@@ -54,6 +70,9 @@ void DebugSpinLock::Lock() {
 
 void SpinLock::Unlock() {
   kassert((_flag % 2) == 1);
+#ifdef __LOCK_PROFILE__
+  _profile->RecordRelease(cpu_ctrl->GetId(), LockProfile::ReadTsc() - _acquired);
+#endif // __LOCK_PROFILE__
   _id = -1;
   _flag++;
 }
@@ -61,17 +80,259 @@ void SpinLock::Unlock() {
 int SpinLock::Trylock() {
   volatile unsigned int flag = GetFlag();
   if (((flag % 2) == 0) && SetFlag(flag, flag + 1)) {
+#ifdef __LOCK_PROFILE__
+    _acquired = LockProfile::ReadTsc();
+    _profile->RecordAcquire(cpu_ctrl->GetId(), 0, 0);
+#endif // __LOCK_PROFILE__
+    return 0;
+  } else {
+    return -1;
+  }
+}
+
+void TicketSpinLock::Lock() {
+#ifdef __KERNEL__
+  kassert(idt->GetHandlingCnt() == 0);
+#endif // __KERNEL__
+  if (IsLocked()) {
+    kassert(_id != cpu_ctrl->GetId());
+  }
+  unsigned int ticket = __sync_fetch_and_add(&_next, 1);
+  while(true) {
+    unsigned int distance = ticket - _serving;
+    if (distance == 0) {
+      break;
+    }
+    for (unsigned int i = 0; i < distance * kBackoff; i++) {
+      asm volatile("pause":::"memory");
+    }
+  }
+  _id = cpu_ctrl->GetId();
+}
+
+void TicketSpinLock::Unlock() {
+  kassert(IsLocked());
+  _id = -1;
+  // 他のCPUは_servingを書き換えないので、CASは要らない
+  __sync_synchronize();
+  _serving = _serving + 1;
+}
+
+int TicketSpinLock::Trylock() {
+  unsigned int serving = _serving;
+  if (__sync_bool_compare_and_swap(&_next, serving, serving + 1)) {
+    _id = cpu_ctrl->GetId();
     return 0;
   } else {
     return -1;
   }
 }
 
+void RwSpinLock::ReadLock() {
+#ifdef __KERNEL__
+  kassert(idt->GetHandlingCnt() == 0);
+#endif // __KERNEL__
+  ReaderSlot &slot = _readers[cpu_ctrl->GetId() % kReaderSlots];
+  while(true) {
+    while(_writer) {
+      asm volatile("pause":::"memory");
+    }
+    // 増やしてから_writerを見る（WriteLockとは逆の順番）ので、
+    // どちらかは必ず相手に気づく
+    __sync_fetch_and_add(&slot.cnt, 1);
+    if (!_writer) {
+      return;
+    }
+    __sync_fetch_and_sub(&slot.cnt, 1);
+  }
+}
+
+void RwSpinLock::ReadUnlock() {
+  // タスクの実行中にCPUは変わらないので、ReadLockと同じ場所になる
+  ReaderSlot &slot = _readers[cpu_ctrl->GetId() % kReaderSlots];
+  kassert(slot.cnt > 0);
+  __sync_fetch_and_sub(&slot.cnt, 1);
+}
+
+void RwSpinLock::WriteLock() {
+  _wlock.Lock();
+  if (_writer_preference) {
+    // 先に宣言して、新しい読み込み側を止める
+    _writer = true;
+    __sync_synchronize();
+    while(HasReaders()) {
+      asm volatile("pause":::"memory");
+    }
+    return;
+  }
+  while(true) {
+    while(HasReaders()) {
+      asm volatile("pause":::"memory");
+    }
+    _writer = true;
+    __sync_synchronize();
+    if (!HasReaders()) {
+      return;
+    }
+    // 読み込み側が先に入ったので、譲る
+    _writer = false;
+  }
+}
+
+void RwSpinLock::WriteUnlock() {
+  kassert(_writer);
+  __sync_synchronize();
+  _writer = false;
+  _wlock.Unlock();
+}
+
+bool RwSpinLock::HasReaders() {
+  for (int i = 0; i < kReaderSlots; i++) {
+    if (_readers[i].cnt != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifdef __LOCK_PROFILE__
+LockProfile * volatile LockProfile::_list = nullptr;
+LockProfile LockProfile::_default("(unnamed)");
+
+// 初めて記録する時に、記録する場所を確保して一覧に加える
+void LockProfile::Register() {
+  if (!__sync_bool_compare_and_swap(&_registered, false, true)) {
+    return;
+  }
+  // 確保中に取ったロックの記録は、_statsがまだ無いので捨てられる
+  int cpus = cpu_ctrl->GetHowManyCpus();
+  virt_addr stats = virtmem_ctrl->AllocZ(sizeof(Stats) * cpus + kCacheLineSize);
+  _cpus = cpus;
+  __sync_synchronize();
+  _stats = reinterpret_cast<Stats *>(alignUp(stats, kCacheLineSize));
+  LockProfile *list;
+  do {
+    list = _list;
+    _next = list;
+  } while(!__sync_bool_compare_and_swap(&_list, list, this));
+}
+
+int LockProfile::GetCpuId() {
+  return cpu_ctrl->GetId();
+}
+
+void LockProfile::RecordAcquire(int cpuid, uint64_t spins, uint64_t wait) {
+  if (!_registered) {
+    Register();
+  }
+  Stats *all = _stats;
+  if (all == nullptr || cpuid < 0 || cpuid >= _cpus) {
+    return;
+  }
+  Stats &stats = all[cpuid];
+  stats.acquisitions++;
+  if (spins != 0) {
+    stats.contended++;
+  }
+  stats.spins += spins;
+  stats.wait_total += wait;
+  if (stats.wait_max < wait) {
+    stats.wait_max = wait;
+  }
+}
+
+void LockProfile::RecordRelease(int cpuid, uint64_t hold) {
+  Stats *all = _stats;
+  if (all == nullptr || cpuid < 0 || cpuid >= _cpus) {
+    return;
+  }
+  Stats &stats = all[cpuid];
+  stats.hold_total += hold;
+  if (stats.hold_max < hold) {
+    stats.hold_max = hold;
+  }
+}
+
+void LockProfile::Dump(Tty *tty) {
+  int num = 0;
+  for (LockProfile *p = _list; p != nullptr; p = p->_next) {
+    num++;
+  }
+  if (num == 0) {
+    return;
+  }
+  LockProfile **profiles = reinterpret_cast<LockProfile **>(virtmem_ctrl->Alloc(sizeof(LockProfile *) * num));
+  // Statsはキャッシュラインに揃える必要があるので、合計は揃えずに持つ
+  struct Sum {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spins;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+  };
+  Sum *sums = reinterpret_cast<Sum *>(virtmem_ctrl->AllocZ(sizeof(Sum) * num));
+  int i = 0;
+  for (LockProfile *p = _list; p != nullptr && i < num; p = p->_next, i++) {
+    profiles[i] = p;
+    Stats *all = p->_stats;
+    if (all == nullptr) {
+      continue;
+    }
+    for (int j = 0; j < p->_cpus; j++) {
+      Stats &s = all[j];
+      sums[i].acquisitions += s.acquisitions;
+      sums[i].contended += s.contended;
+      sums[i].spins += s.spins;
+      sums[i].wait_total += s.wait_total;
+      sums[i].hold_total += s.hold_total;
+      if (sums[i].wait_max < s.wait_max) {
+        sums[i].wait_max = s.wait_max;
+      }
+      if (sums[i].hold_max < s.hold_max) {
+        sums[i].hold_max = s.hold_max;
+      }
+    }
+  }
+  // 待ち時間の合計が長い順に並べる
+  for (int j = 1; j < num; j++) {
+    for (int k = j; k > 0 && sums[k - 1].wait_total < sums[k].wait_total; k--) {
+      LockProfile *p = profiles[k];
+      profiles[k] = profiles[k - 1];
+      profiles[k - 1] = p;
+      Sum s = sums[k];
+      sums[k] = sums[k - 1];
+      sums[k - 1] = s;
+    }
+  }
+  tty->Cprintf("lock: acquired contended spins wait(total/max) hold(avg/max) [cycles]\n");
+  for (int j = 0; j < num; j++) {
+    Sum &s = sums[j];
+    uint64_t hold_avg = (s.acquisitions == 0) ? 0 : s.hold_total / s.acquisitions;
+    tty->Cprintf("%s: %llu %llu %llu %llu/%llu %llu/%llu\n", profiles[j]->_name,
+                 static_cast<unsigned long long>(s.acquisitions),
+                 static_cast<unsigned long long>(s.contended),
+                 static_cast<unsigned long long>(s.spins),
+                 static_cast<unsigned long long>(s.wait_total),
+                 static_cast<unsigned long long>(s.wait_max),
+                 static_cast<unsigned long long>(hold_avg),
+                 static_cast<unsigned long long>(s.hold_max));
+  }
+  virtmem_ctrl->Free(reinterpret_cast<virt_addr>(profiles));
+  virtmem_ctrl->Free(reinterpret_cast<virt_addr>(sums));
+}
+#endif // __LOCK_PROFILE__
+
 #ifdef __KERNEL__
 void IntSpinLock::Lock() {
   if ((_flag % 2) == 1) {
     kassert(_id != cpu_ctrl->GetId());
   }
+#ifdef __LOCK_PROFILE__
+  uint64_t start = LockProfile::ReadTsc();
+  uint64_t spins = 0;
+#endif // __LOCK_PROFILE__
   volatile unsigned int flag = GetFlag();
   while(true) {
     if ((flag % 2) != 1) {
@@ -81,13 +342,23 @@ void IntSpinLock::Lock() {
       }
       this->EnableInt();
     }
+#ifdef __LOCK_PROFILE__
+    spins++;
+#endif // __LOCK_PROFILE__
     flag = GetFlag();
   }
   _id = cpu_ctrl->GetId();
+#ifdef __LOCK_PROFILE__
+  _acquired = LockProfile::ReadTsc();
+  _profile->RecordAcquire(_id, spins, _acquired - start);
+#endif // __LOCK_PROFILE__
 }
 
 void IntSpinLock::Unlock() {
   kassert((_flag % 2) == 1);
+#ifdef __LOCK_PROFILE__
+  _profile->RecordRelease(cpu_ctrl->GetId(), LockProfile::ReadTsc() - _acquired);
+#endif // __LOCK_PROFILE__
   _id = -1;
   _flag++;
   this->EnableInt();
@@ -96,6 +367,10 @@ void IntSpinLock::Unlock() {
 int IntSpinLock::Trylock() {
   volatile unsigned int flag = GetFlag();
   if (((flag % 2) == 0) && SetFlag(flag, flag + 1)) {
+#ifdef __LOCK_PROFILE__
+    _acquired = LockProfile::ReadTsc();
+    _profile->RecordAcquire(cpu_ctrl->GetId(), 0, 0);
+#endif // __LOCK_PROFILE__
     return 0;
   } else {
     return -1;
@@ -25,6 +25,63 @@
 
 #include <stdint.h>
 
+class Tty;
+
+// ロックの競合の記録
+// __LOCK_PROFILE__を定義してビルドした時だけ、SpinLock、IntSpinLock、RawIntSpinLockが記録する
+// 名前を指定せずに作ったロックは、全てGetDefault()にまとめて記録される
+// 同じ種類のロックで一つを共有すれば、種類毎の記録になる
+// (staticに定義し、破棄しない事)
+class LockProfile {
+public:
+#ifdef __LOCK_PROFILE__
+  constexpr LockProfile(const char *name) : _name(name), _registered(false), _next(nullptr), _stats(nullptr), _cpus(0) {
+  }
+  void RecordAcquire(int cpuid, uint64_t spins, uint64_t wait);
+  void RecordRelease(int cpuid, uint64_t hold);
+  // 記録のある全てのLockProfileを、待ち時間の合計が長い順に出力する
+  static void Dump(Tty *tty);
+  static LockProfile &GetDefault() {
+    return _default;
+  }
+  static uint64_t ReadTsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc":"=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+  }
+  // cpu_ctrlを見られないヘッダ内のロック（RawIntSpinLock）が、記録先のCPUを知るために使う
+  static int GetCpuId();
+private:
+  static const int kCacheLineSize = 64;
+  // CPU毎に記録し、Dumpで合計する（時間はTSCのサイクル数）
+  // 他のCPUと同じキャッシュラインに載せない
+  struct Stats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spins;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+  } __attribute__((aligned(64)));
+  void Register();
+  const char *_name;
+  bool _registered;
+  LockProfile *_next;
+  // 記録する場所は、初めて記録する時にCPUの数(_cpus)だけ確保する
+  // 確保し終わるまでの記録は捨てる
+  Stats * volatile _stats;
+  int _cpus;
+  static LockProfile * volatile _list;
+  static LockProfile _default;
+#else
+  constexpr LockProfile(const char *name) {
+  }
+  static void Dump(Tty *tty) {
+  }
+#endif // __LOCK_PROFILE__
+};
+
 class SpinLockInterface {
 public:
   SpinLockInterface() {}
@@ -41,6 +98,12 @@ public:
 class SpinLock : public SpinLockInterface { 
 public:
   SpinLock() {}
+  // __LOCK_PROFILE__が無い時は、profileは使われない
+#ifdef __LOCK_PROFILE__
+  SpinLock(LockProfile &profile) : _profile(&profile) {}
+#else
+  SpinLock(LockProfile &profile) {}
+#endif // __LOCK_PROFILE__
   virtual ~SpinLock() {}
   virtual volatile unsigned int GetFlag() override {
     return _flag;
@@ -60,6 +123,10 @@ protected:
   }
   volatile unsigned int _flag = 0;
   volatile int _id;
+#ifdef __LOCK_PROFILE__
+  LockProfile *_profile = &LockProfile::GetDefault();
+  uint64_t _acquired;
+#endif // __LOCK_PROFILE__
 };
 
 #ifdef __KERNEL__
@@ -69,6 +136,11 @@ protected:
 class IntSpinLock : public SpinLockInterface {
 public:
   IntSpinLock() {}
+#ifdef __LOCK_PROFILE__
+  IntSpinLock(LockProfile &profile) : _profile(&profile) {}
+#else
+  IntSpinLock(LockProfile &profile) {}
+#endif // __LOCK_PROFILE__
   virtual ~IntSpinLock() {}
   virtual volatile unsigned int GetFlag() override {
     return _flag;
@@ -91,15 +163,50 @@ protected:
   volatile unsigned int _flag = 0;
   volatile int _id;
   bool _did_stop_interrupt = false;
+#ifdef __LOCK_PROFILE__
+  LockProfile *_profile = &LockProfile::GetDefault();
+  uint64_t _acquired;
+#endif // __LOCK_PROFILE__
 };
 #else
 class IntSpinLock : public SpinLock {
 public:
   IntSpinLock() {}
+  IntSpinLock(LockProfile &profile) : SpinLock(profile) {}
   virtual ~IntSpinLock() {}
 };
 #endif // __KERNEL__
 
+// 取りに来た順にロックを渡すSpinLock（チケットロック）
+// 待っている間は自分の番までの距離に比例して間隔を空けるので、
+// 競合が多い時でもロックのキャッシュラインを奪い合いにくい
+// 割り込みハンドラ内では使えないので注意
+class TicketSpinLock : public SpinLockInterface {
+public:
+  TicketSpinLock() {}
+  virtual ~TicketSpinLock() {}
+  // 待っているCPUの数（ロックを持っているCPUも含む）
+  virtual volatile unsigned int GetFlag() override {
+    return _next - _serving;
+  }
+  virtual volatile int GetProcId() override {
+    return _id;
+  }
+  virtual void Lock() override;
+  virtual void Unlock() override;
+  virtual int Trylock() override;
+  virtual bool IsLocked() override {
+    return _next != _serving;
+  }
+private:
+  // 次に配るチケットと、ロックを持っているチケット
+  volatile unsigned int _next = 0;
+  volatile unsigned int _serving = 0;
+  volatile int _id = -1;
+  // 一つ前の順番あたりに待つpauseの回数
+  static const int kBackoff = 32;
+};
+
 class DebugSpinLock : public SpinLock {
 public:
   DebugSpinLock() {
@@ -112,6 +219,136 @@ private:
   static const int kKey = 0x13572468;
 };
 
+// 仮想関数を使わず、全てインライン展開されるSpinLock
+// SpinLockInterfaceとしては使えないので、StaticLockerと組み合わせる
+// 自己デッドロックの検出は行わない（必要ならSpinLockを使う事）
+// 割り込みハンドラ内では使えないので注意
+class RawSpinLock {
+public:
+  RawSpinLock() {}
+  ~RawSpinLock() {}
+  void Lock() {
+    while(true) {
+      unsigned int flag = _flag;
+      if ((flag % 2) == 0 && __sync_bool_compare_and_swap(&_flag, flag, flag + 1)) {
+        return;
+      }
+      asm volatile("pause":::"memory");
+    }
+  }
+  void Unlock() {
+    asm volatile("":::"memory");
+    _flag++;
+  }
+  int Trylock() {
+    unsigned int flag = _flag;
+    if (((flag % 2) == 0) && __sync_bool_compare_and_swap(&_flag, flag, flag + 1)) {
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+  bool IsLocked() {
+    return ((_flag % 2) == 1);
+  }
+private:
+  volatile unsigned int _flag = 0;
+};
+
+// RawSpinLockと同じく全てインライン展開される、割り込みハンドラ内でも使えるSpinLock
+// IntSpinLockと同じく、ロックを持っている間はI/O割り込みを禁止する
+// (カーネル以外では割り込みが無いので、RawSpinLockと同じ動きになる)
+// 自己デッドロックの検出は行わない
+class RawIntSpinLock {
+public:
+  RawIntSpinLock() {}
+  // __LOCK_PROFILE__が無い時は、profileは使われない
+#ifdef __LOCK_PROFILE__
+  RawIntSpinLock(LockProfile &profile) : _profile(&profile) {}
+#else
+  RawIntSpinLock(LockProfile &profile) {}
+#endif // __LOCK_PROFILE__
+  ~RawIntSpinLock() {}
+  void Lock() {
+#ifdef __LOCK_PROFILE__
+    uint64_t start = LockProfile::ReadTsc();
+    uint64_t spins = 0;
+#endif // __LOCK_PROFILE__
+    while(true) {
+      unsigned int flag = _flag;
+      if ((flag % 2) == 0) {
+        bool did_stop_interrupt = DisableInt();
+        if (__sync_bool_compare_and_swap(&_flag, flag, flag + 1)) {
+          // ロックを取れた時だけ書き換える（待っている側が、持っている側の値を壊さないように）
+          _did_stop_interrupt = did_stop_interrupt;
+          break;
+        }
+        EnableInt(did_stop_interrupt);
+      }
+      asm volatile("pause":::"memory");
+#ifdef __LOCK_PROFILE__
+      spins++;
+#endif // __LOCK_PROFILE__
+    }
+#ifdef __LOCK_PROFILE__
+    _acquired = LockProfile::ReadTsc();
+    _profile->RecordAcquire(LockProfile::GetCpuId(), spins, _acquired - start);
+#endif // __LOCK_PROFILE__
+  }
+  void Unlock() {
+#ifdef __LOCK_PROFILE__
+    _profile->RecordRelease(LockProfile::GetCpuId(), LockProfile::ReadTsc() - _acquired);
+#endif // __LOCK_PROFILE__
+    bool did_stop_interrupt = _did_stop_interrupt;
+    asm volatile("":::"memory");
+    _flag++;
+    EnableInt(did_stop_interrupt);
+  }
+  int Trylock() {
+    unsigned int flag = _flag;
+    if ((flag % 2) == 0) {
+      bool did_stop_interrupt = DisableInt();
+      if (__sync_bool_compare_and_swap(&_flag, flag, flag + 1)) {
+        _did_stop_interrupt = did_stop_interrupt;
+#ifdef __LOCK_PROFILE__
+        _acquired = LockProfile::ReadTsc();
+        _profile->RecordAcquire(LockProfile::GetCpuId(), 0, 0);
+#endif // __LOCK_PROFILE__
+        return 0;
+      }
+      EnableInt(did_stop_interrupt);
+    }
+    return -1;
+  }
+  bool IsLocked() {
+    return ((_flag % 2) == 1);
+  }
+private:
+  // 割り込みを禁止し、元々許可されていたかを返す
+  static bool DisableInt() {
+#ifdef __KERNEL__
+    uint64_t if_flag;
+    asm volatile("pushfq; popq %0; andq $0x200, %0; cli;":"=r"(if_flag)::"memory");
+    return (if_flag != 0);
+#else
+    return false;
+#endif // __KERNEL__
+  }
+  static void EnableInt(bool did_stop_interrupt) {
+#ifdef __KERNEL__
+    if (did_stop_interrupt) {
+      asm volatile("sti":::"memory");
+    }
+#endif // __KERNEL__
+  }
+  volatile unsigned int _flag = 0;
+  bool _did_stop_interrupt = false;
+#ifdef __LOCK_PROFILE__
+  LockProfile *_profile = &LockProfile::GetDefault();
+  uint64_t _acquired;
+#endif // __LOCK_PROFILE__
+};
+
 // コンストラクタ、デストラクタでlock,unlockができるラッパー
 // 関数からreturnする際に必ずunlockできるので、unlock忘れを防止する
 class Locker {
@@ -126,4 +363,82 @@ class Locker {
   SpinLockInterface &_lock;
 };
 
+// 読み込みが多いデータ向けのReader-Writerロック
+// 読み込み側はCPUごとに別のキャッシュラインにある数を増減させるだけなので、
+// 読み込み同士ではキャッシュラインを奪い合わない
+// writer_preferenceがtrueなら、書き込み側が待っている間は新しい読み込み側を入れないので、
+// 書き込み側が待たされ続ける事はない（読み込み側のロックを再帰的に取ってはいけない）
+// 割り込みハンドラ内では使えないので注意
+class RwSpinLock {
+public:
+  RwSpinLock(bool writer_preference = true) : _writer_preference(writer_preference) {
+    for (int i = 0; i < kReaderSlots; i++) {
+      _readers[i].cnt = 0;
+    }
+  }
+  ~RwSpinLock() {}
+  void ReadLock();
+  void ReadUnlock();
+  void WriteLock();
+  void WriteUnlock();
+  bool IsWriteLocked() {
+    return _writer;
+  }
+private:
+  bool HasReaders();
+  // CPUの数がこれより多い時は、複数のCPUで共有する
+  static const int kReaderSlots = 16;
+  struct ReaderSlot {
+    volatile int cnt;
+    uint8_t padding[64 - sizeof(int)];
+  };
+  ReaderSlot _readers[kReaderSlots];
+  // 書き込み側がロックを持っているか、待っている
+  volatile bool _writer = false;
+  // 書き込み側同士の排他
+  SpinLock _wlock;
+  const bool _writer_preference;
+};
+
+class ReadLocker {
+ public:
+ ReadLocker(RwSpinLock &lock) : _lock(lock) {
+    _lock.ReadLock();
+  }
+  ~ReadLocker() {
+    _lock.ReadUnlock();
+  }
+ private:
+  RwSpinLock &_lock;
+};
+
+class WriteLocker {
+ public:
+ WriteLocker(RwSpinLock &lock) : _lock(lock) {
+    _lock.WriteLock();
+  }
+  ~WriteLocker() {
+    _lock.WriteUnlock();
+  }
+ private:
+  RwSpinLock &_lock;
+};
+
+// ロックの型を静的に決めるLocker
+// RawSpinLockなら呼び出しが全てインライン展開される
+// SpinLockInterfaceの派生クラスを渡した場合は、仮想関数の呼び出しのままになる
+template <class LockT>
+class StaticLocker {
+ public:
+ StaticLocker(LockT &lock) : _lock(lock) {
+    _lock.Lock();
+  }
+  ~StaticLocker() {
+    _lock.Unlock();
+  }
+ private:
+  StaticLocker(const StaticLocker &);
+  LockT &_lock;
+};
+
 #endif // __RAPH_KERNEL_SPINLOCK_H__
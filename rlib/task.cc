@@ -22,43 +22,85 @@
 
 #include <task.h>
 #include <cpu.h>
+#include <mem/virtmem.h>
 
 #ifdef __KERNEL__
 #include <apic.h>
 #else
 #include <raph.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sched.h>
+#endif // __KERNEL__
+
+LockProfile TaskCtrl::_queue_lock_profile("TaskCtrl::TaskStruct::lock");
+LockProfile TaskCtrl::_callout_lock_profile("TaskCtrl::TaskStruct::dlock");
+LockProfile CountableTask::_lock_profile("CountableTask");
+LockProfile Callout::_lock_profile("Callout");
+Task * volatile TaskCtrl::_taken_slot = nullptr;
+
+#ifdef __KERNEL__
+// ClaimしてからPushし終えるまで、このCPUの割り込みを禁止する
+// (その間に割り込みハンドラがRemoveすると、積み終わるのを待ち続けてしまう)
+class NoInterrupt {
+public:
+  NoInterrupt() {
+    uint64_t if_flag;
+    asm volatile("pushfq; popq %0; andq $0x200, %0;":"=r"(if_flag));
+    _did_stop_interrupt = (if_flag != 0);
+    asm volatile("cli;");
+  }
+  ~NoInterrupt() {
+    if (_did_stop_interrupt) {
+      asm volatile("sti");
+    }
+  }
+private:
+  bool _did_stop_interrupt;
+};
+#else
+class NoInterrupt {
+};
 #endif // __KERNEL__
 
 void TaskCtrl::Setup() {
   int cpus = cpu_ctrl->GetHowManyCpus();
   _task_struct = reinterpret_cast<TaskStruct *>(virtmem_ctrl->Alloc(sizeof(TaskStruct) * cpus));
-  Task *t;
   for (int i = 0; i < cpus; i++) {
     new(&_task_struct[i]) TaskStruct;
 
-    t = virtmem_ctrl->New<Task>();
-    t->_status = Task::Status::kGuard;
-    t->_next = nullptr;
-    t->_prev = nullptr;
-
-    _task_struct[i].top = t;
-    _task_struct[i].bottom = t;
-
-    t = virtmem_ctrl->New<Task>();
-    t->_status = Task::Status::kGuard;
-    t->_next = nullptr;
-    t->_prev = nullptr;
+    for (int j = 0; j < kPriorityNum; j++) {
+      for (int k = 0; k < 2; k++) {
+        Pass &pass = _task_struct[i].passes[j][k];
+        pass.slots = nullptr;
+        pass.capacity = 0;
+        pass.len = 0;
+        pass.pos = 0;
+      }
+      _task_struct[i].current[j] = &_task_struct[i].passes[j][0];
+      _task_struct[i].next[j] = &_task_struct[i].passes[j][1];
+      _task_struct[i].top_sub[j] = nullptr;
+      _task_struct[i].skipped[j] = 0;
+    }
+    _task_struct[i].steal_request = -1;
+    _task_struct[i].forward = -1;
+    _task_struct[i].idle_policy.spin = 0;
+    _task_struct[i].idle_policy.yield = 0;
+#ifndef __KERNEL__
+    _task_struct[i].wakeup = 0;
+#endif // !__KERNEL__
 
-    _task_struct[i].top_sub = t;
-    _task_struct[i].bottom_sub = t;
+    _task_struct[i].callout_check = 0;
+    _task_struct[i].callout_check_cnt = 0;
 
     _task_struct[i].state = TaskQueueState::kNotStarted;
-
-    Callout *dt = virtmem_ctrl->New<Callout>();
-    dt->_next = nullptr;
-    _task_struct[i].dtop = dt;
   }
+
+  // 先頭もキャッシュラインに揃える
+  virt_addr stats = virtmem_ctrl->AllocZ(sizeof(CpuStats) * cpus + kCacheLineSize);
+  _stats = reinterpret_cast<CpuStats *>(alignUp(stats, kCacheLineSize));
 }
 
 void TaskCtrl::Run() {
@@ -68,171 +110,690 @@ void TaskCtrl::Run() {
   apic_ctrl->SetupTimer(kTaskExecutionInterval);
 #endif // __KERNEL__
   while(true) {
-    TaskQueueState oldstate;
-    {
-      Locker locker(_task_struct[cpuid].lock);
-      oldstate = _task_struct[cpuid].state;
+#ifndef __KERNEL__
+    int wakeup = _task_struct[cpuid].wakeup;
+#endif // !__KERNEL__
+    TaskQueueState oldstate = _task_struct[cpuid].state;
 #ifdef __KERNEL__
-      if (oldstate == TaskQueueState::kNotRunning) {
-        apic_ctrl->StopTimer();
-      }
-#endif // __KERNEL__
-      kassert(oldstate == TaskQueueState::kNotRunning
-              || oldstate == TaskQueueState::kSlept);
-      _task_struct[cpuid].state = TaskQueueState::kRunning;
-    }
     if (oldstate == TaskQueueState::kNotRunning) {
-      uint64_t time = timer->GetCntAfterPeriod(timer->ReadMainCnt(), kTaskExecutionInterval);
-      
-      Callout *dt = _task_struct[cpuid].dtop;
-      while(true) {
-        Callout *dtt;
-        {
-          Locker locker(_task_struct[cpuid].dlock);
-          dtt = dt->_next;
-          if (dtt == nullptr) {
-            break;
-          }
-          if (timer->IsGreater(dtt->_time, time)) {
-            break;
-          }
-          if (dtt->_lock.Trylock() < 0) {
-            // retry
-            continue;
-          }
-          dt->_next = dtt->_next;
-        }
-        dtt->_next = nullptr;
-        dtt->_state = Callout::CalloutState::kTaskQueue;
-        Register(cpuid, &dtt->_task);
-        dtt->_lock.Unlock();
-        break;
-      }
+      apic_ctrl->StopTimer();
+    }
+#endif // __KERNEL__
+    kassert(oldstate == TaskQueueState::kNotRunning
+            || oldstate == TaskQueueState::kSlept);
+    _task_struct[cpuid].state = TaskQueueState::kRunning;
+
+    // 眠っている間に登録されたCalloutもあるので、空でなければ確認する
+    if (_task_struct[cpuid].forward == -1 &&
+        (oldstate == TaskQueueState::kNotRunning || !_task_struct[cpuid].wheel.IsEmpty())) {
+      ExpireCallouts(cpuid);
     }
     while(true) {
-      while(true) {
-        Task *t;
-        {
-          Locker locker(_task_struct[cpuid].lock);
-          Task *tt = _task_struct[cpuid].top;
-          t = tt->_next;
-          if (t == nullptr) {
-            kassert(tt == _task_struct[cpuid].bottom);
-            break;
-          }
-          tt->_next = t->_next;
-          if (t->_next == nullptr) {
-            kassert(_task_struct[cpuid].bottom == t);
-            _task_struct[cpuid].bottom = tt;
-          } else {
-            t->_next->_prev = tt;
-          }
-          kassert(t->_status == Task::Status::kWaitingInQueue);
-          t->_status = Task::Status::kRunning;
-          t->_next = nullptr;
-          t->_prev = nullptr;
+      Task *t;
+      while(_task_struct[cpuid].forward == -1 && (t = PopTask(cpuid)) != nullptr) {
+        Execute(cpuid, t);
+
+        if (_task_struct[cpuid].steal_request != -1) {
+          HandleStealRequest(cpuid);
         }
-        t->Execute();
 
-        {
-          Locker locker(_task_struct[cpuid].lock);
-          if (t->_status == Task::Status::kRunning) {
-            t->_status = Task::Status::kOutOfQueue;
+        // タスクが途切れない間も、一定間隔でCalloutの期限を確認する
+        _task_struct[cpuid].callout_check_cnt++;
+        if (_task_struct[cpuid].callout_check_cnt >= kCalloutCheckTasks) {
+          _task_struct[cpuid].callout_check_cnt = 0;
+          if (!_task_struct[cpuid].wheel.IsEmpty() && timer->IsTimePassed(_task_struct[cpuid].callout_check)) {
+            ExpireCallouts(cpuid);
           }
         }
       }
-      Locker locker(_task_struct[cpuid].lock);
 
-      if (_task_struct[cpuid].top->_next == nullptr && _task_struct[cpuid].top_sub->_next == nullptr) {
-        _task_struct[cpuid].state = TaskQueueState::kSlept;
-        break;
+      if (_task_struct[cpuid].forward != -1) {
+        Forward(cpuid);
+      } else if (_work_stealing) {
+        RequestSteal(cpuid);
+      }
+
+      if (WaitIdle(cpuid)) {
+        continue;
       }
-      Task *tmp;
-      tmp = _task_struct[cpuid].top;
-      _task_struct[cpuid].top = _task_struct[cpuid].top_sub;
-      _task_struct[cpuid].top_sub = tmp;
 
-      tmp = _task_struct[cpuid].bottom;
-      _task_struct[cpuid].bottom = _task_struct[cpuid].bottom_sub;
-      _task_struct[cpuid].bottom_sub = tmp;
+#ifndef __KERNEL__
+      // kSleptにする前に読んでおけば、以降のForceWakeupで必ず起きられる
+      wakeup = _task_struct[cpuid].wakeup;
+#endif // !__KERNEL__
 
-      //TODO : FIX THIS : callout isn't executed while this loop is running.
+      // Registerはtop_subに積んだ後に、Removeはnextに移した後にstateを見るので、
+      // kSleptにしてから再確認すれば起床を取りこぼさない
+      _task_struct[cpuid].state = TaskQueueState::kSlept;
+      __sync_synchronize();
+      if (!HasPending(cpuid)) {
+        break;
+      }
+      _task_struct[cpuid].state = TaskQueueState::kRunning;
     }
     
     kassert(_task_struct[cpuid].state == TaskQueueState::kSlept);
 
+    uint64_t next_time;
+    bool has_callout;
     {
       Locker locker(_task_struct[cpuid].dlock);
-      if (_task_struct[cpuid].dtop->_next != nullptr) {
+      has_callout = _task_struct[cpuid].wheel.GetNextTime(next_time);
+      if (has_callout) {
         _task_struct[cpuid].state = TaskQueueState::kNotRunning;
       }
     }
+    uint64_t sleep_start = timer->ReadMainCnt();
 #ifdef __KERNEL__
     apic_ctrl->StartTimer();
     asm volatile("hlt");
 #else
-    usleep(10);
+    Sleep(cpuid, wakeup, has_callout, next_time);
 #endif // __KERNEL__
+    _stats[cpuid].sleeps++;
+    _stats[cpuid].idle_time += timer->ReadMainCnt() - sleep_start;
   }
 }
 
+// IdlePolicyに従って、眠る前にキューを見張る
+// タスクが積まれたらtrueが帰る
+bool TaskCtrl::WaitIdle(int cpuid) {
+  IdlePolicy &policy = _task_struct[cpuid].idle_policy;
+  if (policy.spin <= 0 && policy.yield <= 0) {
+    return false;
+  }
+  // Deactivateされている間は、積まれたタスクも移すだけなので見張らずに眠る
+  if (_task_struct[cpuid].forward != -1) {
+    return false;
+  }
+  uint64_t spin_end = timer->GetCntAfterPeriod(timer->ReadMainCnt(), policy.spin);
+  uint64_t yield_end = timer->GetCntAfterPeriod(spin_end, policy.yield);
+  while(true) {
+    if (HasPending(cpuid)) {
+      return true;
+    }
+    // 見張っている間にDeactivateされたら、すぐに移しに戻る
+    if (_task_struct[cpuid].forward != -1) {
+      return true;
+    }
+    // 見張っている間に登録されたCalloutも、タスク実行中と同じ間隔で確認する
+    if (!_task_struct[cpuid].wheel.IsEmpty() && timer->IsTimePassed(_task_struct[cpuid].callout_check)) {
+      ExpireCallouts(cpuid);
+      continue;
+    }
+    if (timer->IsTimePassed(yield_end)) {
+      return false;
+    }
+#ifdef __KERNEL__
+    asm volatile("pause":::"memory");
+#else
+    if (timer->IsTimePassed(spin_end)) {
+      sched_yield();
+    } else {
+      asm volatile("pause":::"memory");
+    }
+#endif // __KERNEL__
+  }
+}
+
+#ifndef __KERNEL__
+// 次のCalloutの期限が来るか、ForceWakeupされるまで眠る
+void TaskCtrl::Sleep(int cpuid, int wakeup, bool has_callout, uint64_t next_time) {
+  struct timespec timeout;
+  struct timespec *ptimeout = nullptr;
+  uint64_t ns = 0;
+  if (has_callout) {
+    uint64_t cur = timer->ReadMainCnt();
+    if (timer->IsGreater(cur, next_time)) {
+      return;
+    }
+    ns = (next_time - cur) * timer->GetCntClkPeriod();
+    ptimeout = &timeout;
+  }
+  if (_work_stealing) {
+    // 他のCPUからタスクを奪えるよう、定期的に起きる
+    uint64_t interval = static_cast<uint64_t>(kTaskExecutionInterval) * 1000;
+    if (ptimeout == nullptr || ns > interval) {
+      ns = interval;
+      ptimeout = &timeout;
+    }
+  }
+  timeout.tv_sec = ns / 1000000000;
+  timeout.tv_nsec = ns % 1000000000;
+  syscall(SYS_futex, &_task_struct[cpuid].wakeup, FUTEX_WAIT_PRIVATE, wakeup, ptimeout, nullptr, 0);
+}
+#endif // !__KERNEL__
+
+// 期限が来たCalloutを全てタスクキューに移す
+void TaskCtrl::ExpireCallouts(int cpuid) {
+  uint64_t now = timer->ReadMainCnt();
+  uint64_t time = timer->GetCntAfterPeriod(now, kCalloutLookahead);
+  _task_struct[cpuid].callout_check = timer->GetCntAfterPeriod(now, kCalloutCheckInterval);
+
+  while(true) {
+    Callout *dtt;
+    {
+      Locker locker(_task_struct[cpuid].dlock);
+      dtt = _task_struct[cpuid].wheel.GetExpired(time);
+      if (dtt == nullptr) {
+        break;
+      }
+      if (dtt->_lock.Trylock() < 0) {
+        // retry
+        continue;
+      }
+      _task_struct[cpuid].wheel.Remove(dtt);
+    }
+    dtt->_state = Callout::CalloutState::kTaskQueue;
+    Register(cpuid, &dtt->_task);
+    dtt->_lock.Unlock();
+  }
+}
+
+void TaskCtrl::RecordCalloutLateness(int cpuid, uint64_t lateness) {
+  CpuStats &stats = _stats[cpuid];
+  stats.callouts_fired++;
+  if (timer->GetUsecFromCnt(lateness) >= kCalloutLateThreshold) {
+    stats.callouts_late++;
+  }
+  stats.callout_lateness_total += lateness;
+  if (stats.callout_lateness_max < lateness) {
+    stats.callout_lateness_max = lateness;
+  }
+}
+
+// 登録した側のCPUの統計に、ロックを取らずに加算する
+// 呼び出し元は割り込みを禁止しているので、同じCPUの割り込みハンドラとは重ならない
+// (ワーカーでないスレッドが同じCPUとして登録した分は、取りこぼす事がある)
+void TaskCtrl::CountRegistration(int cpuid, int n) {
+  int self = cpu_ctrl->GetId();
+  if (self == cpuid) {
+    _stats[self].registered_local += n;
+  } else {
+    _stats[self].registered_remote += n;
+  }
+}
+
+void TaskCtrl::GetStats(int cpuid, Stats &stats) {
+  CpuStats &cstats = _stats[cpuid];
+  stats.executed = cstats.executed;
+  stats.registered_local = cstats.registered_local;
+  stats.registered_remote = cstats.registered_remote;
+  stats.passes = cstats.passes;
+  stats.queued = cstats.queued;
+  stats.max_queue_depth = cstats.max_queue_depth;
+  stats.sleeps = cstats.sleeps;
+  stats.idle_time = timer->GetUsecFromCnt(cstats.idle_time);
+  stats.stolen = cstats.stolen;
+  stats.callouts_registered = cstats.callouts_registered;
+  stats.callouts_fired = cstats.callouts_fired;
+  stats.callouts_late = cstats.callouts_late;
+  stats.callout_lateness_total = timer->GetUsecFromCnt(cstats.callout_lateness_total);
+  stats.callout_lateness_max = timer->GetUsecFromCnt(cstats.callout_lateness_max);
+}
+
+void TaskCtrl::GetStats(Stats &stats) {
+  stats = Stats();
+  int cpus = cpu_ctrl->GetHowManyCpus();
+  for (int i = 0; i < cpus; i++) {
+    Stats cstats;
+    GetStats(i, cstats);
+    stats.executed += cstats.executed;
+    stats.registered_local += cstats.registered_local;
+    stats.registered_remote += cstats.registered_remote;
+    stats.passes += cstats.passes;
+    stats.queued += cstats.queued;
+    if (stats.max_queue_depth < cstats.max_queue_depth) {
+      stats.max_queue_depth = cstats.max_queue_depth;
+    }
+    stats.sleeps += cstats.sleeps;
+    stats.idle_time += cstats.idle_time;
+    stats.stolen += cstats.stolen;
+    stats.callouts_registered += cstats.callouts_registered;
+    stats.callouts_fired += cstats.callouts_fired;
+    stats.callouts_late += cstats.callouts_late;
+    stats.callout_lateness_total += cstats.callout_lateness_total;
+    if (stats.callout_lateness_max < cstats.callout_lateness_max) {
+      stats.callout_lateness_max = cstats.callout_lateness_max;
+    }
+  }
+}
+
+void TaskCtrl::Execute(int cpuid, Task *t) {
+  _stats[cpuid].executed++;
+  t->Execute();
+  // 実行中にRemoveされたり、再登録されていれば何もしない
+  __sync_bool_compare_and_swap(&t->_status, Task::Status::kRunning, Task::Status::kOutOfQueue);
+}
+
+// 次に実行するタスクを、上のクラスから順に探して取り出す
+// 待たされ続けた下のクラスがあれば、そちらを先に実行する
+// パスを切り替える時以外はロックを取らない
+Task *TaskCtrl::PopTask(int cpuid) {
+  while(true) {
+    int priority = -1;
+    for (int i = 0; i < kPriorityNum; i++) {
+      if (!HasTask(cpuid, i)) {
+        continue;
+      }
+      if (priority == -1) {
+        priority = i;
+      } else {
+        _task_struct[cpuid].skipped[i]++;
+        if (_task_struct[cpuid].skipped[i] >= kStarvationLimit) {
+          priority = i;
+        }
+      }
+    }
+    if (priority == -1) {
+      return nullptr;
+    }
+    _task_struct[cpuid].skipped[priority] = 0;
+    Pass &pass = *_task_struct[cpuid].current[priority];
+    // RemoveとはスロットのCASで取り合う
+    Task *t = __sync_lock_test_and_set(&pass.slots[pass.pos], nullptr);
+    pass.pos++;
+    if (t == nullptr) {
+      // 直前にRemoveされたので、選び直す
+      continue;
+    }
+    // 取り出したタスクは、Removeも状態を変えずに戻る
+    t->_slot = &_taken_slot;
+    kassert(t->_status == Task::Status::kWaitingInQueue);
+    t->_status = Task::Status::kRunning;
+    return t;
+  }
+}
+
+// 現在のパスにタスクが残っているか（Removeで空になったスロットは飛ばす）
+// 現在のパスが終わっていれば、次のパスに切り替える
+bool TaskCtrl::HasTask(int cpuid, int priority) {
+  while(true) {
+    Pass &pass = *_task_struct[cpuid].current[priority];
+    for (; pass.pos < pass.len; pass.pos++) {
+      if (pass.slots[pass.pos] != nullptr) {
+        return true;
+      }
+    }
+    if (!Refill(cpuid, priority)) {
+      return false;
+    }
+  }
+}
+
+// 終わったパスを、次のパスと入れ替える
+bool TaskCtrl::Refill(int cpuid, int priority) {
+  TaskStruct &ts = _task_struct[cpuid];
+  kassert(ts.current[priority]->pos == ts.current[priority]->len);
+  if (ts.top_sub[priority] == nullptr && ts.next[priority]->len == 0) {
+    return false;
+  }
+  StaticLocker<RawIntSpinLock> locker(ts.lock);
+  Stash(cpuid, priority);
+  // 終わったパスのスロットは全て空なので、そのまま次のパスに使う
+  Pass *pass = ts.next[priority];
+  ts.next[priority] = ts.current[priority];
+  ts.next[priority]->len = 0;
+  ts.current[priority] = pass;
+  pass->pos = 0;
+
+  uint64_t depth = pass->len;
+  _stats[cpuid].passes++;
+  _stats[cpuid].queued += depth;
+  if (_stats[cpuid].max_queue_depth < depth) {
+    _stats[cpuid].max_queue_depth = depth;
+  }
+  return true;
+}
+
+// top_subに積まれたタスクを、次のパスのスロットの後ろに移す（lockを取ってから呼ぶ事）
+// 移したタスクの数が帰る
+int TaskCtrl::Stash(int cpuid, int priority) {
+  if (_task_struct[cpuid].top_sub[priority] == nullptr) {
+    return 0;
+  }
+  Task *t = __sync_lock_test_and_set(&_task_struct[cpuid].top_sub[priority], nullptr);
+  int n = 0;
+  for (Task *u = t; u != nullptr; u = u->_next) {
+    n++;
+  }
+  Pass &pass = *_task_struct[cpuid].next[priority];
+  Reserve(pass, pass.len + n);
+  // top_subは新しいものから順に繋がっているので、後ろから詰めてFIFOにする
+  int index = pass.len + n;
+  while(t != nullptr) {
+    Task *next = t->_next;
+    index--;
+    pass.slots[index] = t;
+    t->_slot = &pass.slots[index];
+    t = next;
+  }
+  pass.len = pass.len + n;
+  return n;
+}
+
+// passのスロットをn個以上にする（lockを取ってから呼ぶ事）
+// 入っているタスクの_slotは、新しいスロットを指すように書き換える
+void TaskCtrl::Reserve(Pass &pass, int n) {
+  if (n <= pass.capacity) {
+    return;
+  }
+  int capacity = (pass.capacity == 0) ? kPassMinCapacity : pass.capacity;
+  while(capacity < n) {
+    capacity *= 2;
+  }
+  Task * volatile *slots = reinterpret_cast<Task * volatile *>(virtmem_ctrl->Alloc(sizeof(Task *) * capacity));
+  for (int i = 0; i < pass.len; i++) {
+    Task *t = pass.slots[i];
+    slots[i] = t;
+    if (t != nullptr) {
+      t->_slot = &slots[i];
+    }
+  }
+  if (pass.slots != nullptr) {
+    virtmem_ctrl->Free(reinterpret_cast<virt_addr>(pass.slots));
+  }
+  pass.slots = slots;
+  pass.capacity = capacity;
+}
+
+// 次のパスに積まれたタスクがあるか
+bool TaskCtrl::HasPending(int cpuid) {
+  for (int i = 0; i < kPriorityNum; i++) {
+    if (_task_struct[cpuid].top_sub[i] != nullptr || _task_struct[cpuid].next[i]->len != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// first->...->lastの順に新しいタスクが繋がっているリストをtop_subに積む
+void TaskCtrl::Push(int cpuid, int priority, Task *first, Task *last) {
+  Task *top_sub;
+  do {
+    top_sub = _task_struct[cpuid].top_sub[priority];
+    last->_next = top_sub;
+  } while(!__sync_bool_compare_and_swap(&_task_struct[cpuid].top_sub[priority], top_sub, first));
+}
+
 void TaskCtrl::Register(int cpuid, Task *task) {
   if (!cpu_ctrl->IsValidId(cpuid)) {
     return;
   }
-  Locker locker(_task_struct[cpuid].lock);
-  if (task->_status == Task::Status::kWaitingInQueue) {
+  NoInterrupt no_interrupt;
+  if (Claim(cpuid, task)) {
+    CountRegistration(cpuid, 1);
+    Push(cpuid, static_cast<int>(task->_priority), task, task);
+    ForceWakeup(cpuid);
+  }
+}
+
+void TaskCtrl::RegisterBatch(int cpuid, Task **tasks, int n) {
+  if (!cpu_ctrl->IsValidId(cpuid)) {
     return;
   }
-  task->_cpuid = cpuid;
-  task->_next = nullptr;
-  task->_status = Task::Status::kWaitingInQueue;
-  _task_struct[cpuid].bottom_sub->_next = task;
-  task->_prev = _task_struct[cpuid].bottom_sub;
-  _task_struct[cpuid].bottom_sub = task;
-  
-  ForceWakeup(cpuid);
+  NoInterrupt no_interrupt;
+  Chain chains[kPriorityNum] = {};
+  int claimed = 0;
+  for (int i = 0; i < n; i++) {
+    if (Claim(cpuid, tasks[i])) {
+      chains[static_cast<int>(tasks[i]->_priority)].Link(tasks[i]);
+      claimed++;
+    }
+  }
+  CountRegistration(cpuid, claimed);
+  PushChains(cpuid, chains);
+}
+
+void TaskCtrl::RegisterBatch(Task **tasks, const int *cpuids, int n) {
+  // 積む権利を得たタスクを一旦一つに繋ぎ、CPUとクラスの順に並べ替えてから、
+  // 同じCPUとクラスの並びを一度ずつ積む
+  NoInterrupt no_interrupt;
+  Chain claimed = {};
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    int cpuid = cpuids[i];
+    if (!cpu_ctrl->IsValidId(cpuid)) {
+      continue;
+    }
+    if (Claim(cpuid, tasks[i])) {
+      claimed.Link(tasks[i]);
+      len++;
+    }
+  }
+  Task *t = SortChain(claimed.first, len);
+  while(t != nullptr) {
+    int cpuid = t->_cpuid;
+    int cnt = 0;
+    while(t != nullptr && t->_cpuid == cpuid) {
+      int priority = static_cast<int>(t->_priority);
+      Task *first = t;
+      Task *last = t;
+      cnt++;
+      while(last->_next != nullptr && last->_next->_cpuid == cpuid &&
+            static_cast<int>(last->_next->_priority) == priority) {
+        last = last->_next;
+        cnt++;
+      }
+      // Pushでlast->_nextが書き換わるので、先に次の並びを読んでおく
+      t = last->_next;
+      Push(cpuid, priority, first, last);
+    }
+    CountRegistration(cpuid, cnt);
+    ForceWakeup(cpuid);
+  }
+}
+
+// _nextで繋がったn個のタスクを、積み先のCPUとクラスの順に並べ替える
+// 同じCPUとクラスの中では元の順番を保つ（安定なマージソート）
+// メモリを確保しないので、割り込み内からも呼べる
+Task *TaskCtrl::SortChain(Task *first, int n) {
+  if (n <= 1) {
+    if (first != nullptr) {
+      first->_next = nullptr;
+    }
+    return first;
+  }
+  Task *mid = first;
+  for (int i = 0; i < n / 2; i++) {
+    mid = mid->_next;
+  }
+  Task *left = SortChain(first, n / 2);
+  Task *right = SortChain(mid, n - n / 2);
+  Task *head = nullptr;
+  Task **tail = &head;
+  while(left != nullptr && right != nullptr) {
+    int lkey = left->_cpuid * kPriorityNum + static_cast<int>(left->_priority);
+    int rkey = right->_cpuid * kPriorityNum + static_cast<int>(right->_priority);
+    if (lkey <= rkey) {
+      *tail = left;
+      left = left->_next;
+    } else {
+      *tail = right;
+      right = right->_next;
+    }
+    tail = &(*tail)->_next;
+  }
+  *tail = (left != nullptr) ? left : right;
+  return head;
+}
+
+// 各クラスのリストを一度ずつtop_subに積み、必要なら一度だけ起こす
+void TaskCtrl::PushChains(int cpuid, Chain *chains) {
+  bool pushed = false;
+  for (int i = 0; i < kPriorityNum; i++) {
+    if (chains[i].first != nullptr) {
+      Push(cpuid, i, chains[i].first, chains[i].last);
+      pushed = true;
+    }
+  }
+  if (pushed) {
+    ForceWakeup(cpuid);
+  }
+}
+
+// タスクをcpuidのキューに積む権利を得る
+// falseの時は、既にキューに積まれているので何もしなくてよい
+bool TaskCtrl::Claim(int cpuid, Task *task) {
+  while(true) {
+    Task::Status status = task->_status;
+    switch(status) {
+    case Task::Status::kWaitingInQueue: {
+      return false;
+    }
+    case Task::Status::kRunning:
+    case Task::Status::kOutOfQueue: {
+      // 前に取り出された時の_slotは、kWaitingInQueueにする前に消しておく
+      // (Removeが古いスロットを見て、取り出されたと思わないように)
+      // このタスクが既に別のパスにあれば_slotは書き換わっているので、CASは失敗する
+      __sync_bool_compare_and_swap(&task->_slot, &_taken_slot, nullptr);
+      if (__sync_bool_compare_and_swap(&task->_status, status, Task::Status::kWaitingInQueue)) {
+        task->_cpuid = cpuid;
+        return true;
+      }
+      break;
+    }
+    default: {
+      kassert(false);
+    }
+    }
+  }
+}
+
+void TaskCtrl::Register(int cpuid, Task *task, TaskPriority priority) {
+  task->SetPriority(priority);
+  Register(cpuid, task);
 }
 
 void TaskCtrl::Remove(Task *task) {
   kassert(task->_status != Task::Status::kGuard);
-  int cpuid = task->_cpuid;
-  Locker locker(_task_struct[cpuid].lock);
-  switch(task->_status) {
-  case Task::Status::kWaitingInQueue: {
-    Task *next = task->_next;
-    Task *prev = task->_prev;
-
-    task->_next = nullptr;
-    task->_prev = nullptr;
-
-    kassert(prev != nullptr);
-    prev->_next = next;
-
-    if (next == nullptr) {
-      if (task == _task_struct[cpuid].bottom) {
-        _task_struct[cpuid].bottom = prev;
-      } else if (task == _task_struct[cpuid].bottom_sub) {
-        _task_struct[cpuid].bottom_sub = prev;
-      } else {
-        kassert(false);
+  while(true) {
+    Task::Status status = task->_status;
+    switch(status) {
+    case Task::Status::kWaitingInQueue: {
+      if (RemoveFromQueue(task->_cpuid, task)) {
+        return;
       }
-    } else {
-      next->_prev = prev;
+      // まだ積まれる途中か、奪われたり移されたりしたので、状態を読み直す
+      break;
+    }
+    case Task::Status::kRunning: {
+      if (__sync_bool_compare_and_swap(&task->_status, status, Task::Status::kOutOfQueue)) {
+        return;
+      }
+      break;
+    }
+    case Task::Status::kOutOfQueue: {
+      return;
     }
+    default: {
+      kassert(false);
+    }
+    }
+  }
+}
 
-    prev->_next = next;
-    break;
+// cpuidのキューで待っているtaskを、スロットを空にして外す
+// top_subにあれば、先に次のパスのスロットへ移す（移したタスクは次のパスまで移されないので、均せば定数時間）
+// falseの時は外せていないので、状態を読み直してやり直す事
+bool TaskCtrl::RemoveFromQueue(int cpuid, Task *task) {
+  bool stashed = false;
+  bool removed = false;
+  {
+    StaticLocker<RawIntSpinLock> locker(_task_struct[cpuid].lock);
+    // lockを持っている間は、パスが切り替わったり、タスクが奪われたり移されたりしない
+    // 奪われたり移されたりしたタスクの_cpuidは、移した側がlockを持ったまま書き換えるので、
+    // lockを取ってから読み直し、変わっていればやり直す
+    if (task->_status != Task::Status::kWaitingInQueue || task->_cpuid != cpuid) {
+      return false;
+    }
+    if (task->_slot == nullptr) {
+      // SetPriorityで積んだ時とクラスが変わっている事もあるので、全てのクラスを移す
+      for (int i = 0; i < kPriorityNum; i++) {
+        if (Stash(cpuid, i) != 0) {
+          stashed = true;
+        }
+      }
+    }
+    Task * volatile *slot = task->_slot;
+    if (slot != nullptr) {
+      if (__sync_bool_compare_and_swap(slot, task, nullptr)) {
+        task->_slot = nullptr;
+        task->_status = Task::Status::kOutOfQueue;
+      }
+      // CASに失敗した時は、実行するCPUが取り出した所なので、そのまま実行させる
+      removed = true;
+    }
   }
-  case Task::Status::kRunning:
-  case Task::Status::kOutOfQueue: {
-    break;
+  if (stashed) {
+    // top_subから移したので、眠ろうとしているCPUが見落とさないよう起こしておく
+    __sync_synchronize();
+    ForceWakeup(cpuid);
   }
-  default:{
-    kassert(false);
+  return removed;
+}
+
+void TaskCtrl::RequestSteal(int cpuid) {
+  int cpus = cpu_ctrl->GetHowManyCpus();
+  for (int i = 1; i < cpus; i++) {
+    int victim = (cpuid + i) % cpus;
+    if (_task_struct[victim].state != TaskQueueState::kRunning) {
+      continue;
+    }
+    bool empty = true;
+    for (int j = 0; j < kPriorityNum; j++) {
+      Pass *pass = _task_struct[victim].current[j];
+      if (pass->pos < pass->len) {
+        empty = false;
+      }
+    }
+    if (empty) {
+      continue;
+    }
+    // 実際にタスクを渡すのはvictim自身で、タスクの実行の合間に行われる
+    if (__sync_bool_compare_and_swap(&_task_struct[victim].steal_request, -1, cpuid)) {
+      return;
+    }
   }
+}
+
+// 現在のパスの後半にある、pinされていないタスクを要求元のCPUに渡す
+void TaskCtrl::HandleStealRequest(int cpuid) {
+  int thief = __sync_lock_test_and_set(&_task_struct[cpuid].steal_request, -1);
+  if (thief == -1) {
+    return;
+  }
+
+  bool stolen = false;
+  StaticLocker<RawIntSpinLock> locker(_task_struct[cpuid].lock);
+  for (int i = 0; i < kPriorityNum; i++) {
+    Pass &pass = *_task_struct[cpuid].current[i];
+    int len = pass.len - pass.pos;
+
+    Chain chain = {};
+    for (int index = len / 2; index < len; index++) {
+      Task * volatile &slot = pass.slots[pass.pos + index];
+      Task *t = slot;
+      if (t == nullptr || t->_pinned) {
+        continue;
+      }
+      // lockを持っている間に書き換えるので、Removeは移す前か後のどちらかを見る
+      slot = nullptr;
+      t->_slot = nullptr;
+      t->_cpuid = thief;
+      chain.Link(t);
+      _stats[cpuid].stolen++;
+    }
+
+    if (chain.first != nullptr) {
+      Push(thief, i, chain.first, chain.last);
+      stolen = true;
+    }
+  }
+
+  if (stolen) {
+    ForceWakeup(thief);
   }
-  task->_status = Task::Status::kOutOfQueue;  
 }
 
 void TaskCtrl::RegisterCallout(Callout *task) {
@@ -240,26 +801,19 @@ void TaskCtrl::RegisterCallout(Callout *task) {
   if (!cpu_ctrl->IsValidId(cpuid)) {
     return;
   }
+  int forward = _task_struct[cpuid].forward;
+  if (forward != -1) {
+    // 呼び出し元がCalloutのロックを取っているので、書き換えてよい
+    // (この後でDeactivateされた場合は、ForwardCalloutsが移す)
+    cpuid = forward;
+    task->_cpuid = cpuid;
+  }
+  // Calloutのロックで割り込みが禁止されているので、CountRegistrationと同じく加算するだけでよい
+  _stats[cpu_ctrl->GetId()].callouts_registered++;
   {
     Locker locker(_task_struct[cpuid].dlock);
-  
-    Callout *dt = _task_struct[cpuid].dtop;
-    while(true) {
-      Callout *dtt = dt->_next;
-      if (dt->_next != nullptr) {
-        task->_state = Callout::CalloutState::kCalloutQueue;
-      	task->_next = dtt;
-      	dt->_next = task;
-      	break;
-      }
-      if (timer->IsGreater(dtt->_time, task->_time)) {
-        task->_state = Callout::CalloutState::kCalloutQueue;
-        task->_next = dtt;
-        dt->_next = task;
-        break;
-      }
-      dt = dtt;
-    }
+    task->_state = Callout::CalloutState::kCalloutQueue;
+    _task_struct[cpuid].wheel.Add(task);
   }
 
   ForceWakeup(cpuid);
@@ -270,16 +824,7 @@ void TaskCtrl::CancelCallout(Callout *task) {
   switch(task->_state) {
   case Callout::CalloutState::kCalloutQueue: {
     Locker locker(_task_struct[cpuid].dlock);
-    Callout *dt = _task_struct[cpuid].dtop;
-    while(dt->_next != nullptr) {
-      Callout *dtt = dt->_next;
-      if (dtt == task) {
-        dt->_next = dtt->_next;
-        break;
-      }
-      dt = dtt;
-    }
-    task->_next = nullptr;
+    _task_struct[cpuid].wheel.Remove(task);
     break;
   }
   case Callout::CalloutState::kTaskQueue: {
@@ -296,6 +841,79 @@ void TaskCtrl::CancelCallout(Callout *task) {
   task->_state = Callout::CalloutState::kStopped;
 }
 
+void TaskCtrl::Deactivate(int cpuid, int target) {
+  kassert(cpuid != target);
+  kassert(IsActive(target));
+  _task_struct[cpuid].forward = target;
+  ForceWakeup(cpuid);
+}
+
+void TaskCtrl::Activate(int cpuid) {
+  _task_struct[cpuid].forward = -1;
+  ForceWakeup(cpuid);
+}
+
+// Deactivateされたので、キューに残っているタスクとCalloutを全てforwardに移す
+void TaskCtrl::Forward(int cpuid) {
+  int target = _task_struct[cpuid].forward;
+  bool forwarded = false;
+  {
+    StaticLocker<RawIntSpinLock> locker(_task_struct[cpuid].lock);
+    for (int i = 0; i < kPriorityNum; i++) {
+      Stash(cpuid, i);
+      _task_struct[cpuid].next[i]->pos = 0;
+      Pass *passes[2] = {_task_struct[cpuid].current[i], _task_struct[cpuid].next[i]};
+      Chain chain = {};
+      for (Pass *pass : passes) {
+        for (; pass->pos < pass->len; pass->pos++) {
+          Task *t = pass->slots[pass->pos];
+          if (t == nullptr) {
+            continue;
+          }
+          pass->slots[pass->pos] = nullptr;
+          t->_slot = nullptr;
+          t->_cpuid = target;
+          chain.Link(t);
+        }
+      }
+      _task_struct[cpuid].next[i]->len = 0;
+      if (chain.first != nullptr) {
+        Push(target, i, chain.first, chain.last);
+        forwarded = true;
+      }
+    }
+  }
+  if (forwarded) {
+    ForceWakeup(target);
+  }
+  ForwardCallouts(cpuid, target);
+}
+
+void TaskCtrl::ForwardCallouts(int cpuid, int target) {
+  while(true) {
+    Callout *c;
+    {
+      Locker locker(_task_struct[cpuid].dlock);
+      c = _task_struct[cpuid].wheel.GetAny();
+      if (c == nullptr) {
+        return;
+      }
+      if (c->_lock.Trylock() < 0) {
+        // retry
+        continue;
+      }
+      _task_struct[cpuid].wheel.Remove(c);
+    }
+    c->_cpuid = target;
+    {
+      Locker locker(_task_struct[target].dlock);
+      _task_struct[target].wheel.Add(c);
+    }
+    c->_lock.Unlock();
+    ForceWakeup(target);
+  }
+}
+
 void TaskCtrl::ForceWakeup(int cpuid) {
 #ifdef __KERNEL__
   if (_task_struct[cpuid].state == TaskQueueState::kSlept) {
@@ -303,6 +921,12 @@ void TaskCtrl::ForceWakeup(int cpuid) {
       apic_ctrl->SendIpi(apic_ctrl->GetApicIdFromCpuId(cpuid));
     }
   }
+#else
+  TaskQueueState state = _task_struct[cpuid].state;
+  if (state == TaskQueueState::kSlept || state == TaskQueueState::kNotRunning) {
+    __sync_fetch_and_add(&_task_struct[cpuid].wakeup, 1);
+    syscall(SYS_futex, &_task_struct[cpuid].wakeup, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  }
 #endif // __KERNEL__
 }
 
@@ -350,7 +974,10 @@ void Callout::Cancel() {
 }
 
 void Callout::HandleSub(void *) {
-  if (timer->IsTimePassed(_time)) {
+  uint64_t cur = timer->ReadMainCnt();
+  if (timer->IsGreater(cur, _time)) {
+    // 奪われたり移されたりして、_cpuid以外のCPUで実行される事もある
+    task_ctrl->RecordCalloutLateness(cpu_ctrl->GetId(), cur - _time);
     _state = CalloutState::kHandling;
     _func.Execute();
     _state = CalloutState::kStopped;
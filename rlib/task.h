@@ -27,6 +27,7 @@
 #include <function.h>
 #include <spinlock.h>
 #include <timer.h>
+#include <timerwheel.h>
 
 class Task;
 class Callout;
@@ -39,11 +40,83 @@ public:
     kRunning,
     kSlept,
   };
+  // 上のクラスのタスクほど先に実行される
+  // ただし、下のクラスもkStarvationLimit個に1回は実行される
+  enum class TaskPriority {
+    kHigh,
+    kNormal,
+    kBackground,
+  };
+  static const int kPriorityNum = 3;
   TaskCtrl() {}
   void Setup();
   void Register(int cpuid, Task *task);
+  void Register(int cpuid, Task *task, TaskPriority priority);
+  // 複数のタスクをまとめて登録する
+  // キューへの操作と起床は、CPUと優先度のクラス毎に一度ずつしか行わない
+  void RegisterBatch(int cpuid, Task **tasks, int n);
+  // tasks[i]をcpuids[i]に登録する
+  // 宛先が散らばっていても、キューへの操作と起床はCPUとクラス毎に一度ずつ
+  void RegisterBatch(Task **tasks, const int *cpuids, int n);
+  // 戻った時にはキューから外れているので、タスクを破棄してよい
+  // ただし、実行するCPUが既に取り出していた時は、実行中と同じくそのまま実行される
   void Remove(Task *task);
   void Run();
+  // 有効にすると、タスクが空になったCPUは他のCPUのキューからタスクを奪って実行する
+  // （SetPinnedされたタスクは奪われない）
+  void SetWorkStealing(bool enabled) {
+    _work_stealing = enabled;
+  }
+  // タスクが無くなった時に、眠る前にキューを見張り続ける時間(us)
+  // spinの間はpauseしながら、続くyieldの間は他のスレッドに譲りながら待つ
+  // (カーネルでは譲る先が無いので、yieldの間もpauseする)
+  // 見張っている間は起床させる必要が無いので、Registerも軽くなる
+  // どちらも0（デフォルト）なら、すぐに眠る
+  struct IdlePolicy {
+    int spin;
+    int yield;
+  };
+  void SetIdlePolicy(int cpuid, const IdlePolicy &policy) {
+    _task_struct[cpuid].idle_policy = policy;
+  }
+  // スケジューラの統計情報
+  struct Stats {
+    // 実行したタスクの数
+    uint64_t executed;
+    // このCPUから、自身と他のCPUに登録したタスクの数
+    uint64_t registered_local;
+    uint64_t registered_remote;
+    // top_subを取り出した回数と、取り出したタスクの合計・最大
+    // (queued / passesが平均のキューの長さ)
+    uint64_t passes;
+    uint64_t queued;
+    uint64_t max_queue_depth;
+    // 眠った回数と時間(us)
+    uint64_t sleeps;
+    uint64_t idle_time;
+    // 他のCPUに渡したタスクの数
+    uint64_t stolen;
+    // このCPUから登録したCallout、このCPUで実行されたCalloutの数
+    uint64_t callouts_registered;
+    uint64_t callouts_fired;
+    // kCalloutLateThreshold以上遅れて実行されたCalloutの数と、遅れの合計・最大(us)
+    uint64_t callouts_late;
+    uint64_t callout_lateness_total;
+    uint64_t callout_lateness_max;
+  };
+  // 他のCPUが更新中でもロックは取らないので、おおよその値になる
+  void GetStats(int cpuid, Stats &stats);
+  // 全CPUの合計（最大値は全CPUの最大）
+  void GetStats(Stats &stats);
+  // cpuidのCPUでタスクを実行するのを止め、キューに残っているタスクとCalloutをtargetに移す
+  // 以降にcpuidへ登録されたものもtargetに回される（pinされたものも含む）
+  // targetは有効なCPUでなければならない
+  void Deactivate(int cpuid, int target);
+  // Deactivateしたcpuidで、再びタスクを実行する
+  void Activate(int cpuid);
+  bool IsActive(int cpuid) {
+    return _task_struct[cpuid].forward == -1;
+  }
   TaskQueueState GetState(int cpuid) {
     if (_task_struct == nullptr) {
       return TaskQueueState::kNotStarted;
@@ -67,23 +140,122 @@ public:
   void RegisterCallout(Callout *task);
   void CancelCallout(Callout *task);
   void ForceWakeup(int cpuid);
+  void ExpireCallouts(int cpuid);
+#ifndef __KERNEL__
+  void Sleep(int cpuid, int wakeup, bool has_callout, uint64_t next_time);
+#endif // !__KERNEL__
+  // 実行しているCPUの統計にしか書き込まないので、ロックは不要
+  void RecordCalloutLateness(int cpuid, uint64_t lateness);
+  void CountRegistration(int cpuid, int n);
+  // RegisterBatchで、キューに積むまでタスクを繋いでおくためのリスト
+  struct Chain {
+    Task *first;
+    Task *last;
+    void Link(Task *t);
+  };
+  bool Claim(int cpuid, Task *task);
+  bool RemoveFromQueue(int cpuid, Task *task);
+  void PushChains(int cpuid, Chain *chains);
+  Task *SortChain(Task *first, int n);
+  Task *PopTask(int cpuid);
+  bool HasTask(int cpuid, int priority);
+  void Execute(int cpuid, Task *t);
+  bool Refill(int cpuid, int priority);
+  int Stash(int cpuid, int priority);
+  bool HasPending(int cpuid);
+  void Push(int cpuid, int priority, Task *first, Task *last);
+  void RequestSteal(int cpuid);
+  void HandleStealRequest(int cpuid);
+  void Forward(int cpuid);
+  bool WaitIdle(int cpuid);
+  void ForwardCallouts(int cpuid, int target);
+  // 一つのパスのタスクを、キューに積まれた順に並べたスロット
+  // タスクは自分のスロットを_slotで指しているので、RemoveはCASで一つ空にするだけでよい
+  struct Pass {
+    Task * volatile *slots;
+    int capacity;
+    volatile int len;
+    // 次に取り出すスロット（currentの時だけ使う）
+    int pos;
+  };
+  static const int kPassMinCapacity = 16;
+  void Reserve(Pass &pass, int n);
   struct TaskStruct {
-    // queue
-    Task *top;
-    Task *bottom;
-    Task *top_sub;
-    Task *bottom_sub;
-    IntSpinLock lock;
+    // queue（優先度のクラス毎）
+    // currentは実行中のパスで、このCPUだけがロックを取らずに先頭から取り出す
+    // top_subは次のパスで、ロックを取らずに他のCPUからも積まれる
+    // (新しいものが先頭に来るので、スロットに移す時に反転する)
+    // nextは次のパスのうち、Removeが外せるようにtop_subから先にスロットへ移したもの
+    // lockは、パスの切り替え(Refill)と、Remove、奪う・移す時にだけ取る
+    // (Removeは割り込み内からも呼ばれるので割り込みを禁止し、仮想関数を介さないようRawIntSpinLockにする)
+    Pass *current[kPriorityNum];
+    Pass *next[kPriorityNum];
+    Pass passes[kPriorityNum][2];
+    Task * volatile top_sub[kPriorityNum];
+    RawIntSpinLock lock{_queue_lock_profile};
+    // 上のクラスのタスクを優先したために、実行を見送った回数
+    int skipped[kPriorityNum];
 
-    TaskQueueState state;
+    // work stealingを要求しているCPU（なければ-1）
+    volatile int steal_request;
+    // Deactivateされた時に、タスクを回す先のCPU（なければ-1）
+    volatile int forward;
+    IdlePolicy idle_policy;
+
+    volatile TaskQueueState state;
+#ifndef __KERNEL__
+    // 眠っているCPUを起こすためのfutex
+    volatile int wakeup;
+#endif // !__KERNEL__
 
     // for Callout
-    IntSpinLock dlock;
-    Callout *dtop;
+    IntSpinLock dlock{_callout_lock_profile};
+    TimerWheel wheel;
+    // 次にCalloutの期限を確認する時刻と、前回確認してから実行したタスク数
+    uint64_t callout_check;
+    int callout_check_cnt;
   } *_task_struct = nullptr;
+  static LockProfile _queue_lock_profile;
+  // 取り出されたタスクの_slotは、常に空のこのスロットを指す
+  static Task * volatile _taken_slot;
+  static LockProfile _callout_lock_profile;
+  static const int kCacheLineSize = 64;
+  // 統計情報は各CPUしか書き込まないので、他のCPUと同じキャッシュラインに載せない
+  // ただし、登録の数はワーカー以外のスレッドや割り込み内からも数えるので、アトミックに加算する
+  // 時間は全てtimerのカウントで持つ
+  struct CpuStats {
+    uint64_t executed;
+    uint64_t registered_local;
+    uint64_t registered_remote;
+    uint64_t passes;
+    uint64_t queued;
+    uint64_t max_queue_depth;
+    uint64_t sleeps;
+    uint64_t idle_time;
+    uint64_t stolen;
+    uint64_t callouts_registered;
+    uint64_t callouts_fired;
+    uint64_t callouts_late;
+    uint64_t callout_lateness_total;
+    uint64_t callout_lateness_max;
+  } __attribute__((aligned(kCacheLineSize))) *_stats = nullptr;
   // this const value defines interval of wakeup task controller when all task slept
   // (task controller doesn't sleep if there is any registered tasks)
   static const int kTaskExecutionInterval = 1000; // us
+  // タスクを実行し続けている間、Calloutの期限を確認する間隔
+  // （kCalloutCheckTasks個のタスクを実行する毎に時刻を読む）
+  static const int kCalloutCheckInterval = 100; // us
+  static const int kCalloutCheckTasks = 16;
+  static const int kStarvationLimit = 16;
+  static const int kCalloutLateThreshold = 100; // us
+#ifdef __KERNEL__
+  // タイマー割り込みの間隔以内に期限が来るCalloutは、タスクキューで待たせる
+  static const int kCalloutLookahead = kTaskExecutionInterval; // us
+#else
+  // 期限ちょうどに起きられるので、先取りする必要は無い
+  static const int kCalloutLookahead = 0; // us
+#endif // __KERNEL__
+  bool _work_stealing = false;
 };
 
 class Task {
@@ -103,18 +275,45 @@ public:
   Status GetStatus() {
     return _status;
   }
+  // work stealingが有効な時でも、登録されたCPU以外では実行させない
+  void SetPinned(bool pinned) {
+    _pinned = pinned;
+  }
+  bool IsPinned() {
+    return _pinned;
+  }
+  // 次にRegisterされた時から有効になる
+  void SetPriority(TaskCtrl::TaskPriority priority) {
+    _priority = priority;
+  }
+  TaskCtrl::TaskPriority GetPriority() {
+    return _priority;
+  }
 private:
   void Execute() {
     _func.Execute();
   }
   FunctionBase _func;
   Task *_next;
-  Task *_prev;
-  int _cpuid;
-  Status _status = Status::kOutOfQueue;
+  // 現在のパスか次のパスで、このタスクが入っているスロット
+  // (top_subにある間や、Claimしてから積むまではnullptr)
+  Task * volatile * volatile _slot = nullptr;
+  int _cpuid = 0;
+  volatile Status _status = Status::kOutOfQueue;
+  bool _pinned = false;
+  TaskCtrl::TaskPriority _priority = TaskCtrl::TaskPriority::kNormal;
   friend TaskCtrl;
 };
  
+inline void TaskCtrl::Chain::Link(Task *t) {
+  // Pushに渡せるよう、新しいものを先頭に繋ぐ
+  t->_next = first;
+  first = t;
+  if (last == nullptr) {
+    last = t;
+  }
+}
+
 // Taskがキューに積まれている間にインクリメント可能
 // 割り込み内からも呼び出せる
 // ただし、一定時間後に立ち上げる事や割り当てcpuidを変える事はできない
@@ -140,7 +339,8 @@ public:
 private:
   void HandleSub(void *);
   Task _task;
-  IntSpinLock _lock;
+  IntSpinLock _lock{_lock_profile};
+  static LockProfile _lock_profile;
   FunctionBase _func;
   int _cnt;
   int _cpuid;
@@ -161,6 +361,8 @@ public:
     ClassFunction<Callout> func;
     func.Init(this, &Callout::HandleSub, nullptr);
     _task.SetFunc(func);
+    // 指定されたCPUで実行する
+    _task.SetPinned(true);
   }
   virtual ~Callout() {
   }
@@ -176,15 +378,24 @@ public:
   void SetHandler(uint32_t us);
   void SetHandler(int cpuid, int us);
   void Cancel();
+  // kOutOfQueueになるまでは、実行中か実行待ちなので破棄してはいけない
+  Task::Status GetStatus() {
+    return _task.GetStatus();
+  }
 private:
   void HandleSub(void *);
   int _cpuid;
   Task _task;
   uint64_t _time;
-  Callout *_next;
+  // for TimerWheel
+  Callout *_next = nullptr;
+  Callout **_pprev = nullptr;
+  int _slot;
   FunctionBase _func;
-  IntSpinLock _lock;
+  IntSpinLock _lock{_lock_profile};
+  static LockProfile _lock_profile;
   friend TaskCtrl;
+  friend TimerWheel;
   CalloutState _state = CalloutState::kStopped;
 };
 
@@ -26,8 +26,59 @@
 #include <task.h>
 #include <global.h>
 #include <unistd.h>
-#include <sys/syscall.h>
+#include <sched.h>
+#include <stdio.h>
+#include <dirent.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <tuple>
+
+static const char kSysCpuPath[] = "/sys/devices/system/cpu";
+
+static int ReadInt(const char *path, int default_value) {
+  FILE *fp = fopen(path, "r");
+  if (fp == nullptr) {
+    return default_value;
+  }
+  int value;
+  if (fscanf(fp, "%d", &value) != 1) {
+    value = default_value;
+  }
+  fclose(fp);
+  return value;
+}
+
+// "0-3,8,10-11"のような形式
+static std::vector<int> ReadCpuList(const char *path) {
+  std::vector<int> cpus;
+  FILE *fp = fopen(path, "r");
+  if (fp == nullptr) {
+    return cpus;
+  }
+  int begin;
+  while(fscanf(fp, "%d", &begin) == 1) {
+    int end = begin;
+    int c = fgetc(fp);
+    if (c == '-') {
+      if (fscanf(fp, "%d", &end) != 1) {
+        break;
+      }
+      c = fgetc(fp);
+    }
+    for (int i = begin; i <= end; i++) {
+      cpus.push_back(i);
+    }
+    if (c != ',') {
+      break;
+    }
+  }
+  fclose(fp);
+  return cpus;
+}
+
+thread_local PthreadCtrl::ThreadContext PthreadCtrl::_context;
 
 PthreadCtrl::~PthreadCtrl() {
   for(thread_pool_t::size_type i = 0; i < _thread_pool.size(); i++) {
@@ -36,13 +87,18 @@ PthreadCtrl::~PthreadCtrl() {
 }
 
 void PthreadCtrl::Setup() {
-  // main thread id
-  _thread_ids[0] = GetThreadId();
+  if (_placement != Placement::kNone) {
+    DiscoverTopology();
+    Place();
+  }
+
+  SetupContext(0);
+  Pin(0);
 
   for(thread_pool_t::size_type i = 0; i < _thread_pool.size(); i++) {
     std::unique_ptr<std::thread> th(new std::thread ([this, i]{
-        // sub thread id
-        _thread_ids[i+1] = GetThreadId();
+        SetupContext(i+1);
+        Pin(i+1);
 
         task_ctrl->Run();
     }));
@@ -50,17 +106,198 @@ void PthreadCtrl::Setup() {
   }
 }
 
-volatile int PthreadCtrl::GetId() {
-  for(int i = 0; i < _cpu_nums; i++) {
-    if(_thread_ids[i] == GetThreadId()) {
-      return i;
+void PthreadCtrl::SetupContext(int cpuid) {
+  _context.cpuid = cpuid;
+  for(int i = 0; i < kContextSlotNum; i++) {
+    _context.slot[i] = nullptr;
+  }
+}
+
+void PthreadCtrl::DiscoverTopology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return;
+  }
+  char path[256];
+  snprintf(path, sizeof(path), "%s/online", kSysCpuPath);
+  std::vector<int> online = ReadCpuList(path);
+
+  std::map<std::pair<int, int>, int> cores;
+  for (int os_id : online) {
+    if (os_id >= CPU_SETSIZE || !CPU_ISSET(os_id, &allowed)) {
+      continue;
+    }
+    HwCpu cpu;
+    cpu.os_id = os_id;
+
+    snprintf(path, sizeof(path), "%s/cpu%d/topology/physical_package_id", kSysCpuPath, os_id);
+    int package = ReadInt(path, 0);
+    snprintf(path, sizeof(path), "%s/cpu%d/topology/core_id", kSysCpuPath, os_id);
+    int core_id = ReadInt(path, os_id);
+    // core_idはパッケージ内でしか一意でない
+    auto key = std::make_pair(package, core_id);
+    if (cores.find(key) == cores.end()) {
+      int index = cores.size();
+      cores[key] = index;
+    }
+    cpu.core = cores[key];
+
+    // 最も上のレベルのキャッシュを共有するCPUのうち、最小の番号をキャッシュの番号とする
+    cpu.llc = os_id;
+    int llc_level = 0;
+    for (int i = 0; ; i++) {
+      snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/level", kSysCpuPath, os_id, i);
+      int level = ReadInt(path, -1);
+      if (level < 0) {
+        break;
+      }
+      if (level <= llc_level) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/shared_cpu_list", kSysCpuPath, os_id, i);
+      std::vector<int> shared = ReadCpuList(path);
+      if (!shared.empty()) {
+        llc_level = level;
+        cpu.llc = *std::min_element(shared.begin(), shared.end());
+      }
+    }
+
+    // NUMAノードは cpuN/nodeM というディレクトリで分かる
+    cpu.node = 0;
+    snprintf(path, sizeof(path), "%s/cpu%d", kSysCpuPath, os_id);
+    DIR *dir = opendir(path);
+    if (dir != nullptr) {
+      struct dirent *entry;
+      while((entry = readdir(dir)) != nullptr) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+          cpu.node = node;
+          break;
+        }
+      }
+      closedir(dir);
+    }
+
+    _hw_cpus.push_back(cpu);
+  }
+}
+
+void PthreadCtrl::Place() {
+  std::vector<int> order;
+  switch(_placement) {
+  case Placement::kExplicit: {
+    for (int os_id : _explicit_cpus) {
+      for (size_t i = 0; i < _hw_cpus.size(); i++) {
+        if (_hw_cpus[i].os_id == os_id) {
+          order.push_back(i);
+          break;
+        }
+      }
+    }
+    break;
+  }
+  case Placement::kCompact:
+  case Placement::kScatter: {
+    for (size_t i = 0; i < _hw_cpus.size(); i++) {
+      order.push_back(i);
     }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+        const HwCpu &x = _hw_cpus[a];
+        const HwCpu &y = _hw_cpus[b];
+        return std::make_tuple(x.node, x.llc, x.core, x.os_id) < std::make_tuple(y.node, y.llc, y.core, y.os_id);
+      });
+    if (_placement == Placement::kCompact) {
+      break;
+    }
+    // 各コアの最初のスレッドを、ノード、キャッシュを順に回りながら使い切ってから、
+    // 各コアの次のスレッドに進む
+    std::map<int, int> threads_in_core, cores_in_llc, llcs_in_node;
+    std::map<int, int> core_rank, llc_rank;
+    std::vector<int> thread_rank(_hw_cpus.size());
+    for (int i : order) {
+      const HwCpu &cpu = _hw_cpus[i];
+      if (llc_rank.find(cpu.llc) == llc_rank.end()) {
+        llc_rank[cpu.llc] = llcs_in_node[cpu.node]++;
+      }
+      if (core_rank.find(cpu.core) == core_rank.end()) {
+        core_rank[cpu.core] = cores_in_llc[cpu.llc]++;
+      }
+      thread_rank[i] = threads_in_core[cpu.core]++;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        const HwCpu &x = _hw_cpus[a];
+        const HwCpu &y = _hw_cpus[b];
+        return std::make_tuple(thread_rank[a], core_rank[x.core], llc_rank[x.llc], x.node) < std::make_tuple(thread_rank[b], core_rank[y.core], llc_rank[y.llc], y.node);
+      });
+    break;
+  }
+  case Placement::kNone: {
+    break;
+  }
+  }
+
+  _bind.assign(_cpu_nums, -1);
+  if (order.empty()) {
+    return;
+  }
+  for (int i = 0; i < _cpu_nums; i++) {
+    _bind[i] = order[i % order.size()];
   }
-  return 0;
 }
 
-int PthreadCtrl::GetThreadId() {
-  return syscall(SYS_gettid);
+void PthreadCtrl::Pin(int cpuid) {
+  HwCpu *cpu = GetHwCpu(cpuid);
+  if (cpu == nullptr) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu->os_id, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+PthreadCtrl::HwCpu *PthreadCtrl::GetHwCpu(int cpuid) {
+  if (cpuid < 0 || static_cast<size_t>(cpuid) >= _bind.size() || _bind[cpuid] < 0) {
+    return nullptr;
+  }
+  return &_hw_cpus[_bind[cpuid]];
+}
+
+int PthreadCtrl::GetCoreId(int cpuid) {
+  HwCpu *cpu = GetHwCpu(cpuid);
+  return cpu == nullptr ? CpuCtrlInterface::GetCoreId(cpuid) : cpu->core;
+}
+
+int PthreadCtrl::GetCacheDomainId(int cpuid) {
+  HwCpu *cpu = GetHwCpu(cpuid);
+  return cpu == nullptr ? CpuCtrlInterface::GetCacheDomainId(cpuid) : cpu->llc;
+}
+
+int PthreadCtrl::GetNodeId(int cpuid) {
+  HwCpu *cpu = GetHwCpu(cpuid);
+  return cpu == nullptr ? CpuCtrlInterface::GetNodeId(cpuid) : cpu->node;
+}
+
+int PthreadCtrl::GetOsCpuId(int cpuid) {
+  HwCpu *cpu = GetHwCpu(cpuid);
+  return cpu == nullptr ? -1 : cpu->os_id;
+}
+
+void PthreadCtrl::SetActiveThreads(int num) {
+  kassert(num >= 1 && num <= _cpu_nums);
+  // 移す先を先に動かしておく
+  for (int i = 0; i < num; i++) {
+    if (!task_ctrl->IsActive(i)) {
+      task_ctrl->Activate(i);
+    }
+  }
+  for (int i = num; i < _cpu_nums; i++) {
+    if (task_ctrl->IsActive(i)) {
+      task_ctrl->Deactivate(i, i % num);
+    }
+  }
+  _active_nums = num;
 }
 
 #endif // !__KERNEL__
@@ -34,25 +34,91 @@
 class PthreadCtrl : public CpuCtrlInterface {
 public:
   PthreadCtrl() : _thread_pool(0) {}
-  PthreadCtrl(int num_threads) : _cpu_nums(num_threads), _thread_pool(num_threads-1) {}
+  PthreadCtrl(int num_threads) : _cpu_nums(num_threads), _active_nums(num_threads), _thread_pool(num_threads-1) {}
   ~PthreadCtrl();
   void Setup();
-  virtual volatile int GetId() override;
+  // スレッド開始時に設定したコンテキストを読むだけなので、システムコールは呼ばない
+  virtual volatile int GetId() override {
+    return _context.cpuid;
+  }
   virtual int GetHowManyCpus() override {
     return _cpu_nums;
   }
 
-private:
-  static const uint8_t kMaxThreadsNumber = 128;
+  // ワーカースレッドを割り当てるCPUの選び方
+  enum class Placement {
+    // 割り当てず、OSに任せる
+    kNone,
+    // SMTの兄弟、キャッシュを共有するコアの順に詰めて割り当てる
+    kCompact,
+    // なるべく別のコア、キャッシュ、NUMAノードに散らして割り当てる
+    kScatter,
+    // 指定したOSのCPU番号の順に割り当てる
+    kExplicit,
+  };
+  // タスクを実行するワーカーの数を、1からGetHowManyCpus()の間で変える
+  // 止めたワーカーのタスクは、動いているワーカーに移される
+  void SetActiveThreads(int num);
+  int GetActiveThreads() {
+    return _active_nums;
+  }
+
+  // Setup()より前に呼ぶ事
+  // CPUが足りない時は先頭から繰り返して割り当てる
+  void SetPlacement(Placement placement) {
+    _placement = placement;
+  }
+  void SetPlacement(const std::vector<int> &os_cpus) {
+    _placement = Placement::kExplicit;
+    _explicit_cpus = os_cpus;
+  }
+  // トポロジは割り当てたCPUのもの（割り当てていなければデフォルト）
+  virtual int GetCoreId(int cpuid) override;
+  virtual int GetCacheDomainId(int cpuid) override;
+  virtual int GetNodeId(int cpuid) override;
+  // 割り当てたOSのCPU番号（割り当てていなければ-1）
+  int GetOsCpuId(int cpuid);
+
+  static const int kContextSlotNum = 8;
+  // スレッドごとのコンテキスト
+  // ワーカースレッドの開始時に一度だけ設定される
+  struct ThreadContext {
+    int cpuid;
+    // CPUごとに頻繁に参照するデータを置くための領域
+    void *slot[kContextSlotNum];
+  };
+  static ThreadContext &GetContext() {
+    return _context;
+  }
 
+private:
   int _cpu_nums = 1;
+  int _active_nums = 1;
 
   typedef std::vector<std::unique_ptr<std::thread>> thread_pool_t;
   thread_pool_t _thread_pool;
 
-  int _thread_ids[kMaxThreadsNumber];
+  void SetupContext(int cpuid);
+
+  // /sys/devices/system/cpu から読み取った、このプロセスが使えるCPU
+  struct HwCpu {
+    int os_id;
+    int core;
+    int llc;
+    int node;
+  };
+  void DiscoverTopology();
+  void Place();
+  void Pin(int cpuid);
+  HwCpu *GetHwCpu(int cpuid);
+  Placement _placement = Placement::kNone;
+  std::vector<int> _explicit_cpus;
+  std::vector<HwCpu> _hw_cpus;
+  // ワーカーごとに割り当てた_hw_cpusの添字
+  std::vector<int> _bind;
 
-  int GetThreadId();
+  // Setup()を呼んでいないスレッドはCPU 0として扱う
+  static thread_local ThreadContext _context;
 };
 
 #endif // !__KERNEL__
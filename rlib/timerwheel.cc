@@ -0,0 +1,234 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#include <timerwheel.h>
+#include <task.h>
+#include <raph.h>
+#include <global.h>
+
+void TimerWheel::Add(Callout *c) {
+  if (_tick_cnt == 0) {
+    _tick_cnt = timer->GetCntAfterPeriod(0, kTickInterval);
+    if (_tick_cnt == 0) {
+      _tick_cnt = 1;
+    }
+  }
+  if (_num == 0) {
+    // 空の時は基準を現在時刻に合わせ直しても構わない
+    _tick = timer->ReadMainCnt() / _tick_cnt;
+  }
+  _num++;
+  Insert(c);
+}
+
+void TimerWheel::Remove(Callout *c) {
+  kassert(_num > 0);
+  Unlink(c);
+  _num--;
+}
+
+Callout *TimerWheel::GetExpired(uint64_t time) {
+  if (_num == 0) {
+    return nullptr;
+  }
+  if (_slot[kExpiredSlot] == nullptr) {
+    Advance(time / _tick_cnt);
+  }
+  return _slot[kExpiredSlot];
+}
+
+Callout *TimerWheel::GetAny() {
+  if (_num == 0) {
+    return nullptr;
+  }
+  if (_slot[kExpiredSlot] != nullptr) {
+    return _slot[kExpiredSlot];
+  }
+  for (int i = 0; i < kSlots / 64; i++) {
+    if (_bitmap[i] != 0) {
+      return _slot[i * 64 + __builtin_ctzll(_bitmap[i])];
+    }
+  }
+  kassert(false);
+  return nullptr;
+}
+
+bool TimerWheel::GetNextTime(uint64_t &time) {
+  if (_num == 0) {
+    return false;
+  }
+  if (_slot[kExpiredSlot] != nullptr) {
+    time = 0;
+    return true;
+  }
+
+  // 1段目は期限そのもの、2段目以降は下の段に入れ直される時刻を使う
+  uint64_t next = 0;
+  bool found = false;
+  int index = _tick & (kLevel0Size - 1);
+  int slot = FindSlot(0, index);
+  if (slot < 0) {
+    slot = FindSlot(0, 0);
+    if (slot >= 0) {
+      slot += kLevel0Size;
+    }
+  }
+  if (slot >= 0) {
+    next = _tick + (slot - index);
+    found = true;
+  }
+  for (int level = 1; level < kLevels; level++) {
+    int shift = kLevel0Bits + (level - 1) * kLevelBits;
+    int lindex = (_tick >> shift) & (kLevelSize - 1);
+    slot = (lindex + 1 < kLevelSize) ? FindSlot(level, lindex + 1) : -1;
+    if (slot < 0) {
+      slot = FindSlot(level, 0);
+      if (slot >= 0) {
+        slot += kLevelSize;
+      }
+    }
+    if (slot < 0) {
+      continue;
+    }
+    uint64_t cascade = ((_tick >> shift) + (slot - lindex)) << shift;
+    if (!found || cascade < next) {
+      next = cascade;
+      found = true;
+    }
+  }
+  kassert(found);
+  time = next * _tick_cnt;
+  return true;
+}
+
+// tickまでのスロットを処理し、期限切れのCalloutを期限切れリストに移す
+void TimerWheel::Advance(uint64_t tick) {
+  const uint64_t mask = kLevel0Size - 1;
+  while(_tick <= tick) {
+    int index = _tick & mask;
+    if (index == 0) {
+      for (int level = 1; level < kLevels; level++) {
+        int lindex = (_tick >> (kLevel0Bits + (level - 1) * kLevelBits)) & (kLevelSize - 1);
+        Cascade(level, lindex);
+        if (lindex != 0) {
+          break;
+        }
+      }
+    }
+
+    Callout *c;
+    while((c = _slot[index]) != nullptr) {
+      Unlink(c);
+      Link(c, kExpiredSlot);
+    }
+    _tick++;
+
+    // 1段目の空のスロットは、次に桁上がりするまで読み飛ばす
+    if ((_tick & mask) != 0) {
+      int next = FindSlot(0, _tick & mask);
+      uint64_t target = (next < 0) ? ((_tick | mask) + 1) : ((_tick & ~mask) + next);
+      if (target > tick + 1) {
+        target = tick + 1;
+      }
+      if (target > _tick) {
+        _tick = target;
+      }
+    }
+  }
+}
+
+void TimerWheel::Insert(Callout *c) {
+  uint64_t expires = GetTick(c->_time);
+  int slot;
+  if (expires < _tick) {
+    // 既に期限が過ぎている
+    slot = GetSlot(0, _tick & (kLevel0Size - 1));
+  } else if (expires - _tick < kLevel0Size) {
+    slot = GetSlot(0, expires & (kLevel0Size - 1));
+  } else {
+    uint64_t idx = expires - _tick;
+    const uint64_t max = (static_cast<uint64_t>(1) << (kLevel0Bits + (kLevels - 1) * kLevelBits)) - 1;
+    if (idx > max) {
+      // 遠すぎるものは最上段に入れ、Cascadeの度に入れ直す
+      expires = _tick + max;
+      idx = max;
+    }
+    int level = 1;
+    while(idx >= (static_cast<uint64_t>(1) << (kLevel0Bits + level * kLevelBits))) {
+      level++;
+    }
+    slot = GetSlot(level, (expires >> (kLevel0Bits + (level - 1) * kLevelBits)) & (kLevelSize - 1));
+  }
+  Link(c, slot);
+}
+
+void TimerWheel::Cascade(int level, int index) {
+  int slot = GetSlot(level, index);
+  Callout *c;
+  while((c = _slot[slot]) != nullptr) {
+    Unlink(c);
+    Insert(c);
+  }
+}
+
+void TimerWheel::Link(Callout *c, int slot) {
+  c->_next = _slot[slot];
+  if (c->_next != nullptr) {
+    c->_next->_pprev = &c->_next;
+  }
+  _slot[slot] = c;
+  c->_pprev = &_slot[slot];
+  c->_slot = slot;
+  if (slot != kExpiredSlot) {
+    _bitmap[slot / 64] |= static_cast<uint64_t>(1) << (slot % 64);
+  }
+}
+
+void TimerWheel::Unlink(Callout *c) {
+  *c->_pprev = c->_next;
+  if (c->_next != nullptr) {
+    c->_next->_pprev = c->_pprev;
+  }
+  int slot = c->_slot;
+  if (slot != kExpiredSlot && _slot[slot] == nullptr) {
+    _bitmap[slot / 64] &= ~(static_cast<uint64_t>(1) << (slot % 64));
+  }
+  c->_next = nullptr;
+  c->_pprev = nullptr;
+}
+
+// level段目のindex番目以降で、最初の空でないスロットの番号を返す
+// 無ければ-1
+int TimerWheel::FindSlot(int level, int index) {
+  int size = (level == 0) ? kLevel0Size : kLevelSize;
+  int base = GetSlot(level, 0);
+  int i = base + index;
+  while(i < base + size) {
+    uint64_t bits = _bitmap[i / 64] >> (i % 64);
+    if (bits != 0) {
+      int found = i + __builtin_ctzll(bits);
+      return (found < base + size) ? found - base : -1;
+    }
+    i = (i / 64 + 1) * 64;
+  }
+  return -1;
+}
@@ -0,0 +1,88 @@
+/*
+ *
+ * Copyright (c) 2016 Raphine Project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Author: Liva
+ * 
+ */
+
+#ifndef __RAPH_LIB_TIMERWHEEL_H__
+#define __RAPH_LIB_TIMERWHEEL_H__
+
+#include <stdint.h>
+
+class Callout;
+
+// Calloutを期限ごとに管理する階層型タイマーホイール
+// 登録、削除、期限切れの取り出しはいずれもO(1)
+// 排他制御は呼び出し側で行う事
+class TimerWheel {
+public:
+  TimerWheel() {
+  }
+  void Add(Callout *c);
+  void Remove(Callout *c);
+  // time以前に期限が来たCalloutを返す（キューからは取り除かない）
+  // 無ければnullptr
+  Callout *GetExpired(uint64_t time);
+  // 次に期限が来るかもしれない時刻を返す（実際の期限はこれ以降）
+  // 空の時はfalseが帰る
+  bool GetNextTime(uint64_t &time);
+  // 期限に関わらず、いずれか一つのCalloutを返す（キューからは取り除かない）
+  // 無ければnullptr
+  Callout *GetAny();
+  bool IsEmpty() {
+    return _num == 0;
+  }
+private:
+  void Advance(uint64_t tick);
+  void Insert(Callout *c);
+  void Cascade(int level, int index);
+  uint64_t GetTick(uint64_t cnt) {
+    // 期限より早く取り出されないよう切り上げる
+    return (cnt + _tick_cnt - 1) / _tick_cnt;
+  }
+  void Link(Callout *c, int slot);
+  void Unlink(Callout *c);
+  int FindSlot(int level, int index);
+
+  // 1段目は256スロット、2段目以降は64スロットずつ
+  static const int kLevel0Bits = 8;
+  static const int kLevelBits = 6;
+  static const int kLevels = 5;
+  static const int kLevel0Size = 1 << kLevel0Bits;
+  static const int kLevelSize = 1 << kLevelBits;
+  static const int kSlots = kLevel0Size + kLevelSize * (kLevels - 1);
+  // 期限切れリストを表すスロット番号
+  static const int kExpiredSlot = kSlots;
+  // 1tickの長さ
+  static const int kTickInterval = 10; // us
+
+  static int GetSlot(int level, int index) {
+    return (level == 0) ? index : kLevel0Size + (level - 1) * kLevelSize + index;
+  }
+
+  Callout *_slot[kSlots + 1] = {};
+  // 空でないスロットのビットマップ
+  uint64_t _bitmap[kSlots / 64] = {};
+  // 次に処理するtick
+  uint64_t _tick = 0;
+  uint64_t _tick_cnt = 0;
+  int _num = 0;
+};
+
+#endif // __RAPH_LIB_TIMERWHEEL_H__
@@ -35,18 +35,52 @@ void Tty::PrintString(String *str) {
   }
 }
 
+IntrusiveQueue<Tty::String> * volatile Tty::String::_pool = nullptr;
+volatile int Tty::String::_pool_cnt = 0;
+LockProfile Tty::_lock_profile("Tty");
+
+IntrusiveQueue<Tty::String> *Tty::String::GetPool() {
+  IntrusiveQueue<String> *pool = _pool;
+  if (pool != nullptr) {
+    return pool;
+  }
+  pool = reinterpret_cast<IntrusiveQueue<String> *>(virtmem_ctrl->Alloc(sizeof(IntrusiveQueue<String>)));
+  new(pool) IntrusiveQueue<String>;
+  if (!__sync_bool_compare_and_swap(&_pool, nullptr, pool)) {
+    // 他のスレッドが先に作った
+    pool->~IntrusiveQueue<String>();
+    virtmem_ctrl->Free(reinterpret_cast<virt_addr>(pool));
+    pool = _pool;
+  }
+  return pool;
+}
+
 Tty::String *Tty::String::New() {
-  String *str = reinterpret_cast<String *>(virtmem_ctrl->Alloc(sizeof(String)));
-  new(str) String;
+  String *str;
+  if (GetPool()->Pop(str)) {
+    __sync_fetch_and_sub(&_pool_cnt, 1);
+  } else {
+    str = reinterpret_cast<String *>(virtmem_ctrl->Alloc(sizeof(String)));
+    new(str) String;
+  }
   str->Init();
   return str;
 }
 
 void Tty::String::Delete() {
-  if (next != nullptr) {
-    next->Delete();
+  IntrusiveQueue<String> *pool = GetPool();
+  String *str = this;
+  while(str != nullptr) {
+    String *next_str = str->next;
+    if (__sync_fetch_and_add(&_pool_cnt, 1) < kPoolMax) {
+      pool->Push(str);
+    } else {
+      __sync_fetch_and_sub(&_pool_cnt, 1);
+      str->~String();
+      virtmem_ctrl->Free(reinterpret_cast<virt_addr>(str));
+    }
+    str = next_str;
   }
-  virtmem_ctrl->Free(reinterpret_cast<virt_addr>(this));
 }
 
 void Tty::Cvprintf_sub(String *str, const char *fmt, va_list args) {
@@ -41,6 +41,8 @@ class Tty {
     func.Init(Handle, reinterpret_cast<void *>(this));
     //TODO cpuid
     _queue.SetFunction(1, func);
+    // 大量に出力しても、他のタスクを長く待たせないようにする
+    _queue.SetBudget({kBudget, 0});
   }
   void Cprintf(const char *fmt, ...) {
     va_list args;
@@ -92,7 +94,7 @@ class Tty {
   int _cx = 0;
   int _cy = 0;
  private:
-  class String {
+  class String : public IntrusiveQueue<String>::Container {
   public:
     enum class Type {
       kSingle,
@@ -133,12 +135,18 @@ class Tty {
     uint8_t str[length];
     int offset;
     String *next;
+  private:
+    // 使い終わったStringは、kPoolMax個までは解放せずに再利用する
+    // 静的な初期化の順序に依存しないよう、poolは初めて使う時に作る
+    static IntrusiveQueue<String> *GetPool();
+    static const int kPoolMax = 32;
+    static IntrusiveQueue<String> * volatile _pool;
+    static volatile int _pool_cnt;
   };
   static void Handle(void *tty){
     Tty *that = reinterpret_cast<Tty *>(tty);
-    void *s;
-    while(that->_queue.Pop(s)) {
-      String *str = reinterpret_cast<String *>(s);
+    String *str;
+    if (that->_queue.Pop(str)) {
       {
         Locker locker(that->_lock);
         that->PrintString(str);
@@ -146,6 +154,8 @@ class Tty {
       str->Delete();
     }
   }
+  // 一度のタスク実行で出力する文字列の数
+  static const int kBudget = 32;
   void Cvprintf_sub(String *str, const char *fmt, va_list args);
   void Printf_sub1(String &str) {
   }
@@ -264,8 +274,9 @@ class Tty {
       PrintString(str);
     }
   }
-  FunctionalQueue _queue;
-  IntSpinLock _lock;
+  FunctionalIntrusiveQueue<String> _queue;
+  IntSpinLock _lock{_lock_profile};
+  static LockProfile _lock_profile;
 };
 
 #ifndef __KERNEL__